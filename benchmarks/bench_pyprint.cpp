@@ -0,0 +1,862 @@
+//
+// Created on 2025/11/15.
+//
+
+#include "../pyprint.h"
+#include <benchmark/benchmark.h>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <new>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <stack>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+using namespace pyprint;
+
+// Stream buffer that discards everything, so only formatting is measured
+class null_buffer: public std::streambuf
+{
+protected:
+    int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+    std::streamsize xsputn(char const*, std::streamsize n) override { return n; }
+};
+
+static null_buffer g_null_buffer;
+static std::ostream g_null_stream(&g_null_buffer);
+
+// Every heap allocation in the process, to report allocations per print call
+static std::atomic<std::size_t> g_allocations{0};
+
+void* operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+// Once inlined next to a new-expression GCC takes this free for a mismatch, but the operator new above uses malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    ::operator delete(ptr);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+// Sinks the coverage benchmarks run against: formatting only, and formatting plus a real stream
+struct null_sink
+{
+    std::ostream& stream() { return g_null_stream; }
+    void reset() {}
+};
+
+struct string_sink
+{
+    std::ostringstream oss;
+    std::ostream& stream() { return oss; }
+    void reset() { oss.seekp(0); }
+};
+
+// Print args once per iteration, reporting output bytes/sec and heap allocations per call
+template<typename Sink, typename... Ts>
+static void run_print(benchmark::State& state, Ts const&... args)
+{
+    Sink sink;
+    std::size_t const bytes = formatted_size(args...);
+    std::size_t const allocations = g_allocations.load(std::memory_order_relaxed);
+    for (auto _ : state)
+    {
+        sink.reset();
+        print(args..., params{.out = sink.stream()});
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bytes));
+    state.counters["allocs_per_call"] = benchmark::Counter(
+        static_cast<double>(g_allocations.load(std::memory_order_relaxed) - allocations),
+        benchmark::Counter::kAvgIterations);
+}
+
+template<typename T>
+static std::vector<T> make_values(std::size_t n)
+{
+    std::mt19937 rng(42);
+    std::vector<T> values;
+    values.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if constexpr (std::is_same_v<T, std::string>)
+        {
+            values.push_back("item" + std::to_string(rng() % 100000));
+        }
+        else if constexpr (std::is_floating_point_v<T>)
+        {
+            values.push_back(static_cast<T>(rng() % 1000000) / 1000);
+        }
+        else
+        {
+            values.push_back(static_cast<T>(rng() % 1000000));
+        }
+    }
+    return values;
+}
+
+template<typename Sink>
+static void BM_scalars(benchmark::State& state)
+{
+    run_print<Sink>(state, 42, -7LL, 3.14159, 'c', true, "text", std::string("string"));
+}
+BENCHMARK_TEMPLATE(BM_scalars, null_sink);
+BENCHMARK_TEMPLATE(BM_scalars, string_sink);
+
+template<typename Sink>
+static void BM_long_argument_list(benchmark::State& state)
+{
+    run_print<Sink>(state, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
+                    "a", "b", "c", "d", "e", 1.5, 2.5, 3.5, 4.5, 5.5);
+}
+BENCHMARK_TEMPLATE(BM_long_argument_list, null_sink);
+BENCHMARK_TEMPLATE(BM_long_argument_list, string_sink);
+
+template<typename Sink, typename T>
+static void BM_vector(benchmark::State& state)
+{
+    auto const values = make_values<T>(static_cast<std::size_t>(state.range(0)));
+    run_print<Sink>(state, values);
+}
+BENCHMARK_TEMPLATE(BM_vector, null_sink, int)->Arg(1000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_vector, string_sink, int)->Arg(1000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_vector, null_sink, double)->Arg(1000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_vector, string_sink, double)->Arg(1000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_vector, null_sink, std::string)->Arg(1000)->Arg(100000);
+BENCHMARK_TEMPLATE(BM_vector, string_sink, std::string)->Arg(1000)->Arg(100000);
+
+template<typename Sink>
+static void BM_nested_map(benchmark::State& state)
+{
+    std::map<std::string, std::vector<std::pair<int, int>>> m;
+    for (int i = 0; i < 100; ++i)
+    {
+        auto& pairs = m["key" + std::to_string(i)];
+        for (int j = 0; j < 20; ++j)
+        {
+            pairs.emplace_back(i, j * 1000);
+        }
+    }
+    run_print<Sink>(state, m);
+}
+BENCHMARK_TEMPLATE(BM_nested_map, null_sink);
+BENCHMARK_TEMPLATE(BM_nested_map, string_sink);
+
+template<typename Sink>
+static void BM_tuples(benchmark::State& state)
+{
+    std::vector<std::tuple<int, double, std::string>> tuples;
+    for (int i = 0; i < 1000; ++i)
+    {
+        tuples.emplace_back(i, i * 0.5, "t" + std::to_string(i));
+    }
+    run_print<Sink>(state, tuples);
+}
+BENCHMARK_TEMPLATE(BM_tuples, null_sink);
+BENCHMARK_TEMPLATE(BM_tuples, string_sink);
+
+template<typename Sink, std::size_t N>
+static void BM_bitset(benchmark::State& state)
+{
+    std::bitset<N> bits;
+    for (std::size_t i = 0; i < N; i += 3)
+    {
+        bits.set(i);
+    }
+    run_print<Sink>(state, bits);
+}
+BENCHMARK_TEMPLATE(BM_bitset, null_sink, 64);
+BENCHMARK_TEMPLATE(BM_bitset, string_sink, 64);
+BENCHMARK_TEMPLATE(BM_bitset, null_sink, 65536);
+BENCHMARK_TEMPLATE(BM_bitset, string_sink, 65536);
+
+template<typename Sink, typename Adapter>
+static void BM_adapter(benchmark::State& state)
+{
+    Adapter adapter;
+    for (int value : make_values<int>(static_cast<std::size_t>(state.range(0))))
+    {
+        adapter.push(value);
+    }
+    run_print<Sink>(state, adapter);
+}
+BENCHMARK_TEMPLATE(BM_adapter, null_sink, std::stack<int>)->Arg(10000);
+BENCHMARK_TEMPLATE(BM_adapter, string_sink, std::stack<int>)->Arg(10000);
+BENCHMARK_TEMPLATE(BM_adapter, null_sink, std::queue<int>)->Arg(10000);
+BENCHMARK_TEMPLATE(BM_adapter, string_sink, std::queue<int>)->Arg(10000);
+BENCHMARK_TEMPLATE(BM_adapter, null_sink, std::priority_queue<int>)->Arg(10000);
+BENCHMARK_TEMPLATE(BM_adapter, string_sink, std::priority_queue<int>)->Arg(10000);
+
+// Large object that prints a single short token: its copy cost has nothing to do with its output
+struct heavy_payload
+{
+    int tag;
+    std::vector<char> bytes;
+};
+
+std::ostream& operator<<(std::ostream& os, heavy_payload const& h)
+{
+    return os << h.tag;
+}
+
+// Output is always "1\n", so the cost must stay flat as the payload grows
+static void BM_print_heavy_payload(benchmark::State& state)
+{
+    heavy_payload h{1, std::vector<char>(static_cast<size_t>(state.range(0)))};
+    for (auto _ : state)
+    {
+        print(h, params{.out = g_null_stream});
+    }
+    state.SetLabel("payload " + std::to_string(state.range(0)) + " bytes");
+}
+BENCHMARK(BM_print_heavy_payload)->RangeMultiplier(16)->Range(1 << 4, 1 << 24);
+
+// Same payload without params, which goes through the default-params path
+static void BM_print_heavy_payload_multi(benchmark::State& state)
+{
+    heavy_payload h{1, std::vector<char>(static_cast<size_t>(state.range(0)))};
+    for (auto _ : state)
+    {
+        print(h, h, h, params{.out = g_null_stream});
+    }
+}
+BENCHMARK(BM_print_heavy_payload_multi)->RangeMultiplier(16)->Range(1 << 4, 1 << 24);
+
+// Cost scales with the number of printed elements
+static void BM_print_vector_int(benchmark::State& state)
+{
+    std::vector<int> v(static_cast<size_t>(state.range(0)), 42);
+    for (auto _ : state)
+    {
+        print(v, params{.out = g_null_stream});
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_print_vector_int)->RangeMultiplier(16)->Range(1 << 4, 1 << 20);
+
+// Rendering to a string through a fresh stringstream, as callers had to before format()
+static void BM_stringstream_capture(benchmark::State& state)
+{
+    std::vector<int> v(16, 42);
+    for (auto _ : state)
+    {
+        std::stringstream ss;
+        print("values:", v, params{.out = ss});
+        benchmark::DoNotOptimize(ss.str());
+    }
+}
+BENCHMARK(BM_stringstream_capture);
+
+static void BM_format_string(benchmark::State& state)
+{
+    std::vector<int> v(16, 42);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(format("values:", v));
+    }
+}
+BENCHMARK(BM_format_string);
+
+static void BM_format_to_stack(benchmark::State& state)
+{
+    std::vector<int> v(16, 42);
+    char out[256];
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(format_to(out, "values:", v));
+    }
+}
+BENCHMARK(BM_format_to_stack);
+
+// Sizing a log record before reserving it: counting with measure, against formatting to find out
+static std::map<std::string, std::vector<std::int64_t>> make_record()
+{
+    std::map<std::string, std::vector<std::int64_t>> record;
+    for (int i = 0; i < 16; ++i)
+    {
+        record["field" + std::to_string(i)] = make_values<std::int64_t>(64);
+    }
+    return record;
+}
+
+static void BM_measure_record(benchmark::State& state)
+{
+    auto const record = make_record();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(measure(record, params{.out = g_null_stream}));
+    }
+}
+BENCHMARK(BM_measure_record);
+
+static void BM_format_record_size(benchmark::State& state)
+{
+    auto const record = make_record();
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(format(record).size());
+    }
+}
+BENCHMARK(BM_format_record_size);
+
+// Printing a huge vector with a numpy-style threshold costs the same at any size
+static void BM_print_truncated_vector(benchmark::State& state)
+{
+    std::vector<int> v(static_cast<size_t>(state.range(0)), 42);
+    for (auto _ : state)
+    {
+        print(v, params{.out = g_null_stream, .max_items = 1000});
+    }
+}
+BENCHMARK(BM_print_truncated_vector)->RangeMultiplier(32)->Range(1 << 10, 1 << 25);
+
+// Separators given at run time through params
+static void BM_print_runtime_sep(benchmark::State& state)
+{
+    std::pair<int, int> pr{1, 2};
+    for (auto _ : state)
+    {
+        print(1, 2, 3, 4, 5, 6, 7, 8, pr, pr, params{.sep = ", ", .end = ";\n", .out = g_null_stream});
+    }
+}
+BENCHMARK(BM_print_runtime_sep);
+
+// The same line with separator and end fixed at compile time
+static void BM_print_static_sep(benchmark::State& state)
+{
+    std::pair<int, int> pr{1, 2};
+    for (auto _ : state)
+    {
+        print<static_sep<',', ' '>, static_end<';', '\n'>>(1, 2, 3, 4, 5, 6, 7, 8, pr, pr, params{.out = g_null_stream});
+    }
+}
+BENCHMARK(BM_print_static_sep);
+
+// Formatting alone, the part of an atomic print that runs without the lock
+static void BM_format_threads(benchmark::State& state)
+{
+    std::vector<int> v(16, 42);
+    char out[256];
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(format_to(out, "worker", state.thread_index(), v));
+    }
+}
+BENCHMARK(BM_format_threads)->ThreadRange(1, 32)->UseRealTime();
+
+// Atomic lines from several threads to one stream, showing the cost of the per-stream lock
+static void BM_print_atomic_threads(benchmark::State& state)
+{
+    std::vector<int> v(16, 42);
+    for (auto _ : state)
+    {
+        print("worker", state.thread_index(), v, params{.out = g_null_stream, .atomic = true});
+    }
+}
+BENCHMARK(BM_print_atomic_threads)->ThreadRange(1, 32)->UseRealTime();
+
+// Stream buffer standing in for a slow device: every write takes about 20us
+class slow_buffer: public std::streambuf
+{
+protected:
+    int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+
+    std::streamsize xsputn(char const*, std::streamsize n) override
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+        return n;
+    }
+};
+
+static slow_buffer g_slow_buffer;
+static std::ostream g_slow_stream(&g_slow_buffer);
+
+static void BM_print_slow_sink(benchmark::State& state)
+{
+    std::vector<int> v(16, 42);
+    for (auto _ : state)
+    {
+        print("worker", 1, v, params{.out = g_slow_stream});
+    }
+}
+BENCHMARK(BM_print_slow_sink);
+
+// Caller-side cost of async_print; the ring drops lines the slow sink cannot keep up with
+static void BM_async_print_slow_sink(benchmark::State& state)
+{
+    async_printer printer(async_printer::options{.capacity = 1 << 16, .when_full = async_printer::overflow::drop});
+    std::vector<int> v(16, 42);
+    for (auto _ : state)
+    {
+        printer.print("worker", 1, v, params{.out = g_slow_stream});
+    }
+    state.counters["dropped"] = static_cast<double>(printer.dropped());
+}
+BENCHMARK(BM_async_print_slow_sink);
+
+static void BM_async_print_null_sink(benchmark::State& state)
+{
+    std::vector<int> v(16, 42);
+    for (auto _ : state)
+    {
+        async_print("worker", 1, v, params{.out = g_null_stream});
+    }
+    default_async_printer().drain();
+}
+BENCHMARK(BM_async_print_null_sink);
+
+// The pre-existing adapter path: copy the adapter, then pop it empty
+template<typename Adapter>
+static void copy_and_pop_print(Adapter const& arg, std::ostream& out)
+{
+    Adapter copy = arg;
+    out << '[';
+    bool first = true;
+    while (!copy.empty())
+    {
+        if (!first)
+        {
+            out << ',';
+        }
+        first = false;
+        if constexpr (traits::is_std_queue_v<Adapter>)
+        {
+            out << copy.front();
+        }
+        else
+        {
+            out << copy.top();
+        }
+        copy.pop();
+    }
+    out << ']' << '\n';
+}
+
+template<typename Adapter>
+static Adapter make_adapter(size_t n)
+{
+    std::mt19937 rng(42);
+    Adapter a;
+    for (size_t i = 0; i < n; ++i)
+    {
+        a.push(static_cast<int>(rng() % 1000000));
+    }
+    return a;
+}
+
+template<typename Adapter>
+static void BM_adapter_print(benchmark::State& state)
+{
+    auto a = make_adapter<Adapter>(static_cast<size_t>(state.range(0)));
+    for (auto _ : state)
+    {
+        print(a, params{.out = g_null_stream});
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+template<typename Adapter>
+static void BM_adapter_copy_and_pop(benchmark::State& state)
+{
+    auto a = make_adapter<Adapter>(static_cast<size_t>(state.range(0)));
+    for (auto _ : state)
+    {
+        copy_and_pop_print(a, g_null_stream);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK_TEMPLATE(BM_adapter_print, std::stack<int>)->Arg(1000000);
+BENCHMARK_TEMPLATE(BM_adapter_copy_and_pop, std::stack<int>)->Arg(1000000);
+BENCHMARK_TEMPLATE(BM_adapter_print, std::queue<int>)->Arg(1000000);
+BENCHMARK_TEMPLATE(BM_adapter_copy_and_pop, std::queue<int>)->Arg(1000000);
+BENCHMARK_TEMPLATE(BM_adapter_print, std::priority_queue<int>)->Arg(1000000);
+BENCHMARK_TEMPLATE(BM_adapter_copy_and_pop, std::priority_queue<int>)->Arg(1000000);
+
+// Contiguous numeric containers are formatted in one run; a deque with the same
+// values still goes element by element and serves as the reference
+template<typename Container>
+static void BM_wide_numbers(benchmark::State& state)
+{
+    using T = typename Container::value_type;
+    std::mt19937_64 rng(42);
+    Container values;
+    for (std::int64_t i = 0; i < state.range(0); ++i)
+    {
+        values.push_back(static_cast<T>(rng() >> (rng() % 64)));
+    }
+    std::size_t const bytes = format(values).size();
+    for (auto _ : state)
+    {
+        print(values, params{.out = g_null_stream});
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * bytes));
+}
+BENCHMARK_TEMPLATE(BM_wide_numbers, std::vector<int>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_wide_numbers, std::deque<int>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_wide_numbers, std::vector<std::int64_t>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_wide_numbers, std::deque<std::int64_t>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_wide_numbers, std::vector<double>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_wide_numbers, std::deque<double>)->Arg(1 << 20);
+
+// A million doubles and a million strings formatted on 1, 4 and 16 threads
+template <typename T>
+static void BM_parallel(benchmark::State& state)
+{
+    std::mt19937_64 rng(42);
+    std::vector<T> values;
+    for (std::int64_t i = 0; i < (1 << 20); ++i)
+    {
+        if constexpr (std::is_same_v<T, std::string>)
+        {
+            values.push_back(std::to_string(rng()));
+        }
+        else
+        {
+            values.push_back(static_cast<T>(rng()) / 3.0);
+        }
+    }
+    unsigned const threads = static_cast<unsigned>(state.range(0));
+    std::size_t const bytes = format(values).size();
+    for (auto _ : state)
+    {
+        print(values, params{.out = g_null_stream, .parallel = threads});
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * bytes));
+}
+BENCHMARK_TEMPLATE(BM_parallel, double)->Arg(1)->Arg(4)->Arg(16)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_parallel, std::string)->Arg(1)->Arg(4)->Arg(16)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// The same dump of numbers and records written as text and as MessagePack
+static void BM_dump_encoding(benchmark::State& state)
+{
+    std::mt19937_64 rng(42);
+    std::vector<double> samples(1 << 18);
+    std::vector<std::pair<int, std::string>> records(1 << 14);
+    for (auto& sample : samples)
+    {
+        sample = static_cast<double>(rng()) / 7.0;
+    }
+    for (auto& record : records)
+    {
+        record = {static_cast<int>(rng() >> 40), std::to_string(rng())};
+    }
+    params const p{.out = g_null_stream, .encode = state.range(0) ? encoding::msgpack : encoding::text};
+    std::size_t const bytes = format(samples, records, p).size();
+    for (auto _ : state)
+    {
+        print(samples, records, p);
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * bytes));
+    state.SetLabel(state.range(0) ? "msgpack" : "text");
+}
+BENCHMARK(BM_dump_encoding)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// A hot print held back by each kind of limit, against printing every time
+template <typename Limit>
+static void BM_limited(benchmark::State& state)
+{
+    std::vector<int> const values(100, 12345);
+    Limit limit(Limit::argument);
+    for (auto _ : state)
+    {
+        print_limited(limit, "request", values, params{.out = g_null_stream});
+    }
+}
+
+struct unlimited
+{
+    static constexpr int argument = 0;
+
+    explicit unlimited(int) {}
+
+    bool admit(std::uint64_t& suppressed) noexcept
+    {
+        suppressed = 0;
+        return true;
+    }
+};
+
+struct every_thousandth: limit::every_n
+{
+    static constexpr std::uint64_t argument = 1000;
+    using limit::every_n::every_n;
+};
+
+struct ten_per_second: limit::per_second
+{
+    static constexpr double argument = 10;
+    using limit::per_second::per_second;
+};
+
+struct one_in_thousand: limit::sample
+{
+    static constexpr double argument = 0.001;
+    using limit::sample::sample;
+};
+
+BENCHMARK_TEMPLATE(BM_limited, unlimited);
+BENCHMARK_TEMPLATE(BM_limited, every_thousandth);
+BENCHMARK_TEMPLATE(BM_limited, ten_per_second);
+BENCHMARK_TEMPLATE(BM_limited, one_in_thousand);
+
+// The same line sent to 1 to 8 streams: one print with params::tee against one print per stream
+static void BM_fan_out_tee(benchmark::State& state)
+{
+    std::vector<int> const values(100, 12345);
+    std::deque<std::ostream> outs;
+    for (std::int64_t i = 0; i < state.range(0); ++i)
+    {
+        outs.emplace_back(&g_null_buffer);
+    }
+    params p{.out = outs[0]};
+    for (std::size_t i = 1; i < outs.size(); ++i)
+    {
+        p.tee[i - 1] = outs[i];
+    }
+    for (auto _ : state)
+    {
+        print("request", values, p);
+    }
+    state.SetLabel(std::to_string(state.range(0)) + " outputs");
+}
+BENCHMARK(BM_fan_out_tee)->DenseRange(1, 8);
+
+static void BM_fan_out_repeated(benchmark::State& state)
+{
+    std::vector<int> const values(100, 12345);
+    std::deque<std::ostream> outs;
+    for (std::int64_t i = 0; i < state.range(0); ++i)
+    {
+        outs.emplace_back(&g_null_buffer);
+    }
+    for (auto _ : state)
+    {
+        for (std::ostream& out : outs)
+        {
+            print("request", values, params{.out = out});
+        }
+    }
+    state.SetLabel(std::to_string(state.range(0)) + " outputs");
+}
+BENCHMARK(BM_fan_out_repeated)->DenseRange(1, 8);
+
+// A lookup table dumped again and again while it does not change: formatted each time, reused from
+// render_cache, and the memcpy of its text that a reuse comes down to
+static std::map<int, std::string> make_lookup_table(std::int64_t n)
+{
+    std::map<int, std::string> table;
+    for (int i = 0; i < n; ++i)
+    {
+        table.emplace(i * 7, "entry-" + std::to_string(i));
+    }
+    return table;
+}
+
+static void BM_dump_table(benchmark::State& state)
+{
+    auto const table = make_lookup_table(state.range(0));
+    for (auto _ : state)
+    {
+        print(table, params{.out = g_null_stream});
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(format(table).size()));
+}
+BENCHMARK(BM_dump_table)->RangeMultiplier(16)->Range(1 << 4, 1 << 16);
+
+static void BM_dump_table_cached(benchmark::State& state)
+{
+    auto const table = make_lookup_table(state.range(0));
+    render_cache cache;
+    for (auto _ : state)
+    {
+        print(cached(table, 1, cache), params{.out = g_null_stream});
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(format(table).size()));
+}
+BENCHMARK(BM_dump_table_cached)->RangeMultiplier(16)->Range(1 << 4, 1 << 16);
+
+static void BM_dump_table_memcpy(benchmark::State& state)
+{
+    std::string const text = format(make_lookup_table(state.range(0)));
+    std::string copy(text.size(), '\0');
+    for (auto _ : state)
+    {
+        std::memcpy(copy.data(), text.data(), text.size());
+        benchmark::DoNotOptimize(copy.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(text.size()));
+}
+BENCHMARK(BM_dump_table_memcpy)->RangeMultiplier(16)->Range(1 << 4, 1 << 16);
+
+// What the hot thread pays to record a line with defer, against formatting it with print; the drain
+// that formats the deferred lines later runs outside the timed loop
+static void BM_hot_path_print(benchmark::State& state)
+{
+    std::array<double, 4> const sample = {0.25, 1.5, -3.75, 1e-9};
+    std::uint64_t sequence = 0;
+    for (auto _ : state)
+    {
+        print("tick", ++sequence, 3.14159, sample, params{.out = g_null_stream});
+    }
+}
+BENCHMARK(BM_hot_path_print);
+
+static void BM_hot_path_defer(benchmark::State& state)
+{
+    std::array<double, 4> const sample = {0.25, 1.5, -3.75, 1e-9};
+    std::uint64_t sequence = 0;
+    deferred_log log;
+    for (auto _ : state)
+    {
+        log.defer("tick", ++sequence, 3.14159, sample, params{.out = g_null_stream});
+        if (sequence % 65536 == 0)
+        {
+            state.PauseTiming();
+            log.drain();
+            state.ResumeTiming();
+        }
+    }
+}
+BENCHMARK(BM_hot_path_defer);
+
+// A domain type printed through operator<< and the same type through pyprint::formatter
+struct streamed_id
+{
+    std::uint64_t value;
+};
+
+static std::ostream& operator<<(std::ostream& os, streamed_id const& id)
+{
+    return os << "ID-" << id.value;
+}
+
+struct formatted_id
+{
+    std::uint64_t value;
+};
+
+template<>
+struct pyprint::formatter<formatted_id>
+{
+    std::size_t size_hint(formatted_id const&) const { return 24; }
+
+    void format(formatted_id const& id, appender& out) const
+    {
+        char* first = out.reserve(24);
+        std::memcpy(first, "ID-", 3);
+        out.commit(static_cast<std::size_t>(std::to_chars(first + 3, first + 24, id.value).ptr - first));
+    }
+};
+
+template<typename Id>
+static void BM_domain_ids(benchmark::State& state)
+{
+    std::vector<Id> ids;
+    for (std::uint64_t i = 0; i < 1000; ++i)
+    {
+        ids.push_back(Id{i * 1000003});
+    }
+    for (auto _ : state)
+    {
+        print(ids, params{.out = g_null_stream});
+    }
+    state.SetItemsProcessed(state.iterations() * 1000);
+}
+BENCHMARK_TEMPLATE(BM_domain_ids, streamed_id);
+BENCHMARK_TEMPLATE(BM_domain_ids, formatted_id);
+
+#if defined(PYPRINT_HAS_POSIX)
+// Dumping 10000 preformatted 7 KB lines to a file on tmpfs, so the numbers
+// reflect the path from formatter to page cache rather than formatting or disk
+static std::string dump_path()
+{
+    return (::access("/dev/shm", W_OK) == 0 ? "/dev/shm/" : "/tmp/") + std::string("pyprint_bench_dump");
+}
+
+template<typename Write>
+static void run_dump(benchmark::State& state, Write write)
+{
+    std::string const line = format(make_values<int>(1000), params{.end = ""});
+    std::string const path = dump_path();
+    for (auto _ : state)
+    {
+        write(path, line);
+    }
+    std::remove(path.c_str());
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * (line.size() + 1) * 10000));
+}
+
+static void BM_dump_ofstream(benchmark::State& state)
+{
+    run_dump(state, [](std::string const& path, std::string const& line)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (int i = 0; i < 10000; ++i)
+        {
+            print(line, params{.out = out});
+        }
+    });
+}
+BENCHMARK(BM_dump_ofstream)->Unit(benchmark::kMillisecond);
+
+static void BM_dump_fd_sink(benchmark::State& state)
+{
+    run_dump(state, [](std::string const& path, std::string const& line)
+    {
+        fd_sink out(path.c_str());
+        for (int i = 0; i < 10000; ++i)
+        {
+            print(line, params{.to = &out});
+        }
+    });
+}
+BENCHMARK(BM_dump_fd_sink)->Unit(benchmark::kMillisecond);
+
+static void BM_dump_mmap_sink(benchmark::State& state)
+{
+    run_dump(state, [](std::string const& path, std::string const& line)
+    {
+        mmap_sink out(path.c_str());
+        for (int i = 0; i < 10000; ++i)
+        {
+            print(line, params{.to = &out});
+        }
+    });
+}
+BENCHMARK(BM_dump_mmap_sink)->Unit(benchmark::kMillisecond);
+#endif
+
+BENCHMARK_MAIN();
@@ -0,0 +1,20 @@
+# Generates a translation unit with many print calls, for measuring how long pyprint takes to compile.
+# Each call takes 1 to 20 arguments, with types mixed so that argument lists rarely repeat.
+function(pyprint_generate_compile_bench path count)
+    set(values "i" "d" "s" "v" "\"text\"" "'c'" "m" "std::make_pair(i, d)")
+    set(source "#include \"${PROJECT_SOURCE_DIR}/pyprint.h\"\n#include <map>\n#include <string>\n#include <vector>\n\n")
+    string(APPEND source "using pyprint::params;\n")
+    string(APPEND source "using nested = std::map<std::string, std::vector<double>>;\n")
+    foreach(call RANGE 1 ${count})
+        math(EXPR arity "${call} % 20 + 1")
+        set(args "")
+        foreach(arg RANGE 1 ${arity})
+            math(EXPR index "(${call} * 7 + ${arg} * ${arg} * 3) % 8")
+            list(GET values ${index} value)
+            string(APPEND args "${value}, ")
+        endforeach()
+        string(APPEND source "\nvoid print_${call}(std::ostream& os, int i, double d, std::string const& s, std::vector<int> const& v, nested const& m)\n{\n")
+        string(APPEND source "    pyprint::print(${args}params{.out = os});\n}\n")
+    endforeach()
+    file(WRITE "${path}" "${source}")
+endfunction()
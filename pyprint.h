@@ -5,25 +5,187 @@
 #ifndef PYPRINT_PYPRINT_H
 #define PYPRINT_PYPRINT_H
 
+#include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <locale>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
 #include <queue>
 #include <stack>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PYPRINT_HAS_POSIX 1
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PYPRINT_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
 
 
 namespace pyprint
 {
+    class flush_policy;
+    class sink;
+    class async_printer;
+
+    // How std::bitset values are written: binary as operator<< does, binary with '_' between groups
+    // of 4 bits, or "0x" followed by one hex digit per 4 bits
+    enum class bitset_format
+    {
+        binary,
+        grouped,
+        hex
+    };
+
+    // How print encodes its output: as text, or as MessagePack for tools to read back (see pyprint_msgpack.h).
+    // In MessagePack each print call is one array of its arguments; containers, pairs and tuples are
+    // arrays, strings and characters are str, and contiguous runs of numbers are one typed_array_ext.
+    enum class encoding
+    {
+        text,
+        msgpack
+    };
+
+    namespace msgpack
+    {
+        // Application ext types: payload is an element code ('b','B','h','H','i','I','q','Q' for 1, 2, 4 and
+        // 8-byte signed and unsigned integers, 'f','d' for float and double) and the raw little-endian elements
+        inline constexpr std::int8_t typed_array_ext = 1;
+        // Payload is the bit count as 4 big-endian bytes, then the bits 8 per byte, lowest byte first
+        inline constexpr std::int8_t bitset_ext = 2;
+    }
+
+    // Another place a line is written to: a stream or a sink
+    struct destination
+    {
+        destination() noexcept = default;
+        destination(std::ostream& out) noexcept: stream(&out) {}
+        destination(sink& to) noexcept: to(&to) {}
+
+        explicit operator bool() const noexcept
+        {
+            return stream || to;
+        }
+
+        std::ostream* stream = nullptr;
+        sink* to = nullptr;
+    };
+
     struct params
     {
         char const* sep = " ";
         char const* end = "\n";
         std::ostream& out = std::cout;
         bool flush = false;
+        // Batch output and decide when to flush it (see flush_policy); null writes every line straight through
+        flush_policy* policy = nullptr;
+        // Write the line under a per-stream lock so lines printed from concurrent threads never interleave;
+        // out's format state is then also read and updated under that lock
+        bool atomic = false;
+        // Containers with more than max_items elements show only edge_items from each end around "..."
+        // (forward-only ranges show just the head); 0 prints everything
+        std::size_t max_items = 0;
+        std::size_t edge_items = 3;
+        // Containers nested deeper than max_depth print as [...]; 0 means no limit
+        std::size_t max_depth = 0;
+        bitset_format bits = bitset_format::binary;
+        // Containers of more than 2 * 16384 random-access items are formatted on up to this many threads,
+        // in chunks joined in order; 0 or 1 uses only the calling thread. Elements are then printed
+        // concurrently, so their operator<< or formatter must be safe to call from several threads.
+        unsigned parallel = 0;
+        // MessagePack output ignores sep, end and the stream's format state
+        encoding encode = encoding::text;
+        // Write lines to this sink instead of out (see fd_sink, mmap_sink); values get default formatting
+        // and policy and atomic do not apply, since sinks batch and serialize writes themselves
+        sink* to = nullptr;
+        // Also write the line, formatted once, to up to 7 more streams or sinks: .tee = {std::cerr, file}.
+        // They get the same bytes, formatted by out's state, and the same flush and atomic treatment.
+        destination tee[7] = {};
+        // Hand the writes to tee streams to this printer's background thread instead of making them here
+        async_printer* tee_async = nullptr;
+    };
+
+    // Separator and end fixed at compile time, given as characters: print<static_sep<',', ' '>>(...)
+    template<char... Cs>
+    struct static_sep
+    {
+        static constexpr char value[sizeof...(Cs) + 1] = {Cs..., '\0'};
+    };
+
+    template<char... Cs>
+    struct static_end
+    {
+        static constexpr char value[sizeof...(Cs) + 1] = {Cs..., '\0'};
     };
 
+    class appender;
+    class render_cache;
+
+    template <typename T>
+    struct cached_view;
+
+    // Specialize to print a type straight into pyprint's buffer instead of through operator<<, which it
+    // takes precedence over. A specialization provides
+    //     void format(T const& value, appender& out) const;
+    // and optionally, to have room reserved beforehand,
+    //     std::size_t size_hint(T const& value) const;
+    // What it appends directly ignores the stream's format state, including width; values it passes
+    // to appender::print are formatted as print would format them.
+    template<typename T, typename = void>
+    struct formatter {};
+
     namespace traits
     {
+        // Check if pyprint::formatter<T> is specialized
+        template<typename T, typename = void>
+        struct has_formatter: std::false_type {};
+
+        template<typename T>
+        struct has_formatter<T, std::void_t<decltype(std::declval<formatter<T> const&>().format(
+            std::declval<T const&>(), std::declval<appender&>()))>>: std::true_type {};
+
+        template<typename T>
+        inline constexpr bool has_formatter_v = has_formatter<T>::value;
+
+        // Check if pyprint::formatter<T> gives a size hint
+        template<typename T, typename = void>
+        struct has_size_hint: std::false_type {};
+
+        template<typename T>
+        struct has_size_hint<T, std::void_t<decltype(std::declval<formatter<T> const&>().size_hint(
+            std::declval<T const&>()))>>: std::true_type {};
+
+        template<typename T>
+        inline constexpr bool has_size_hint_v = has_size_hint<T>::value;
+
         // Check if T can be printed directly to ostream
         template<typename T, typename = void>
         struct is_plain_printable: std::false_type {};
@@ -36,21 +198,94 @@ namespace pyprint
         template<typename T>
         inline constexpr bool is_plain_printable_v = is_plain_printable<T>::value;
 
-        // Check if T is iterable (has begin() and end())
+        // Check if It's category derives from Tag; iterators without an iterator_category never do
+        template<typename It, typename Tag, typename = void>
+        struct is_iterator_of: std::false_type {};
+
+        template<typename It, typename Tag>
+        struct is_iterator_of<It, Tag, std::void_t<typename std::iterator_traits<It>::iterator_category>>:
+            std::is_base_of<Tag, typename std::iterator_traits<It>::iterator_category> {};
+
+        template<typename It, typename Tag>
+        inline constexpr bool is_iterator_of_v = is_iterator_of<It, Tag>::value;
+
+        // Check if It can be read from once in order: it has an input iterator_category or, with C++20
+        // ranges, satisfies std::input_iterator (view iterators may leave the category out)
+        template<typename It>
+        inline constexpr bool is_input_iterator_v = is_iterator_of_v<It, std::input_iterator_tag>
+#if defined(__cpp_lib_ranges)
+            || std::input_iterator<It>
+#endif
+            ;
+
+        // Check if T is iterable: begin() gives an input iterator and end() anything it compares unequal
+        // to, the same iterator type or a sentinel
         template<typename T, typename = void>
         struct is_iterable: std::false_type {};
 
         template<typename T>
         struct is_iterable<T, std::void_t<
-           decltype(std::begin(std::declval<T&>())),
-           decltype(std::end(std::declval<T&>())),
-           typename std::iterator_traits<decltype(std::begin(std::declval<T&>()))>::iterator_category,
-           typename std::iterator_traits<decltype(std::end(std::declval<T&>()))>::iterator_category
+           decltype(std::begin(std::declval<T const&>()) != std::end(std::declval<T const&>())),
+           std::enable_if_t<is_input_iterator_v<decltype(std::begin(std::declval<T const&>()))>>
        >>: std::true_type {};
 
         template<typename T>
         inline constexpr bool is_iterable_v = is_iterable<T>::value;
 
+        // Check if T reports its size in constant time (std::size works on it)
+        template<typename T, typename = void>
+        struct has_size: std::false_type {};
+
+        template<typename T>
+        struct has_size<T, std::void_t<decltype(std::size(std::declval<T const&>()))>>: std::true_type {};
+
+        template<typename T>
+        inline constexpr bool has_size_v = has_size<T>::value;
+
+        // Check if T stores its elements contiguously (std::data gives a pointer to them)
+        template<typename T, typename = void>
+        struct is_contiguous: std::false_type {};
+
+        template<typename T>
+        struct is_contiguous<T, std::void_t<
+            decltype(std::size(std::declval<T const&>())),
+            std::enable_if_t<std::is_pointer_v<decltype(std::data(std::declval<T const&>()))>>
+        >>: std::true_type {};
+
+        template<typename T>
+        inline constexpr bool is_contiguous_v = is_contiguous<T>::value;
+
+        // Check if T is a sized container with random-access iterators, which can be split into chunks
+        template<typename T, typename = void>
+        struct is_random_access: std::false_type {};
+
+        template<typename T>
+        struct is_random_access<T, std::enable_if_t<has_size_v<T> && is_iterator_of_v<
+            decltype(std::begin(std::declval<T const&>())), std::random_access_iterator_tag>>>: std::true_type {};
+
+        template<typename T>
+        inline constexpr bool is_random_access_v = is_random_access<T>::value;
+
+        // Check if T is a contiguous container of arithmetic values, which can be formatted as one run
+        template<typename T, typename = void>
+        struct is_contiguous_arithmetic: std::false_type {};
+
+        // Numbers the fast path formats itself, without a stream or a user formatter
+        template<typename T>
+        inline constexpr bool is_fast_number_v = !has_formatter_v<T>
+            && ((std::is_integral_v<T> && sizeof(T) <= sizeof(long long))
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+            || std::is_floating_point_v<T>
+#endif
+            );
+
+        template<typename T>
+        struct is_contiguous_arithmetic<T, std::enable_if_t<is_contiguous_v<T>>>: std::bool_constant<is_fast_number_v<
+            std::remove_cv_t<std::remove_pointer_t<decltype(std::data(std::declval<T const&>()))>>>> {};
+
+        template<typename T>
+        inline constexpr bool is_contiguous_arithmetic_v = is_contiguous_arithmetic<T>::value;
+
         // Check if T is std::pair
         template<typename T>
         struct is_pair: std::false_type {};
@@ -61,6 +296,16 @@ namespace pyprint
         template<typename T>
         inline constexpr bool is_pair_v = is_pair<T>::value;
 
+        // Check if T is a pyprint::cached_view
+        template<typename T>
+        struct is_cached_view: std::false_type {};
+
+        template<typename T>
+        struct is_cached_view<cached_view<T>>: std::true_type {};
+
+        template<typename T>
+        inline constexpr bool is_cached_view_v = is_cached_view<T>::value;
+
         // Check if T is std::array
         template<typename T>
         struct is_std_array: std::false_type {};
@@ -120,144 +365,4235 @@ namespace pyprint
 
         template<typename T>
         inline constexpr bool is_std_queue_v = is_std_queue<T>::value;
-    }
 
-    inline void print(params const& p = {})
-    {
-        p.out << p.end;
+        // Check if T is std::priority_queue
+        template<typename T>
+        struct is_priority_queue: std::false_type {};
+
+        template<typename T, typename Container, typename Compare>
+        struct is_priority_queue<std::priority_queue<T, Container, Compare>>: std::true_type {};
+
+        template<typename T>
+        inline constexpr bool is_priority_queue_v = is_priority_queue<T>::value;
+
+        // Check if T is a narrow character type, which ostream prints as a character rather than a number
+        template<typename T>
+        inline constexpr bool is_character_v =
+            std::is_same_v<T, char> || std::is_same_v<T, signed char> || std::is_same_v<T, unsigned char>;
+
+        // Check if T is a narrow string (std::string, std::string_view, char pointer or char array)
+        template<typename T>
+        inline constexpr bool is_string_like_v =
+            std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view> ||
+            std::is_same_v<std::decay_t<T>, char const*> || std::is_same_v<std::decay_t<T>, char*>;
+
+        // Check if the last type of a pack is params
+        template<typename... Ts>
+        struct ends_with_params: std::false_type {};
+
+        template<typename T, typename... Ts>
+        struct ends_with_params<T, Ts...>: ends_with_params<Ts...> {};
+
+        template<>
+        struct ends_with_params<params>: std::true_type {};
+
+        template<typename... Ts>
+        inline constexpr bool ends_with_params_v = ends_with_params<Ts...>::value;
+
+        // Check if T is a static_sep
+        template<typename T>
+        struct is_static_sep: std::false_type {};
+
+        template<char... Cs>
+        struct is_static_sep<static_sep<Cs...>>: std::true_type {};
+
+        // Check if T is a static_end
+        template<typename T>
+        struct is_static_end: std::false_type {};
+
+        template<char... Cs>
+        struct is_static_end<static_end<Cs...>>: std::true_type {};
+
+        // Find the option among Options that satisfies Is, or Default if none does
+        template<template<typename> class Is, typename Default, typename... Options>
+        struct find_option
+        {
+            using type = Default;
+        };
+
+        template<template<typename> class Is, typename Default, typename Option, typename... Options>
+        struct find_option<Is, Default, Option, Options...>
+        {
+            using type = std::conditional_t<Is<Option>::value, Option,
+                typename find_option<Is, Default, Options...>::type>;
+        };
+
+        template<typename... Options>
+        inline constexpr bool are_static_options_v =
+            ((is_static_sep<Options>::value || is_static_end<Options>::value) && ...);
+
+        // Always false, but only once T is known (for static_assert in discarded branches)
+        template<typename T>
+        inline constexpr bool always_false_v = false;
+
+        // How _print handles T, worked out once per type
+        enum class category
+        {
+            cached,
+            formatted,
+            plain,
+            iterable,
+            pair,
+            tuple,
+            adapter,
+            unprintable
+        };
+
+        template<typename T>
+        constexpr category _category() noexcept
+        {
+            if constexpr (is_cached_view_v<T>)
+            {
+                return category::cached;
+            }
+            else if constexpr (has_formatter_v<T>)
+            {
+                return category::formatted;
+            }
+            else if constexpr (is_plain_printable_v<T>)
+            {
+                return category::plain;
+            }
+            else if constexpr (is_iterable_v<T> && !std::is_convertible_v<T, std::string>)
+            {
+                return category::iterable;
+            }
+            else if constexpr (is_pair_v<T>)
+            {
+                return category::pair;
+            }
+            else if constexpr (is_tuple_v<T>)
+            {
+                return category::tuple;
+            }
+            else if constexpr (is_container_adapter_v<T>)
+            {
+                return category::adapter;
+            }
+            else
+            {
+                return category::unprintable;
+            }
+        }
+
+        template<typename T>
+        inline constexpr category category_v = _category<T>();
     }
 
     namespace details
     {
         using namespace traits;
-        // Ensured that params is passed as the last argument
 
-        template <typename T, typename... Ts>
-        void _print(T const& arg, Ts const&... args)
+        // Growable char buffer that a whole print call is formatted into before a single write
+        class buffer
         {
-            auto args_ref = std::forward_as_tuple(args...);
-            auto const& p = std::get<sizeof...(args) - 1>(args_ref);
+        public:
+            buffer() noexcept = default;
+            buffer(buffer const&) = delete;
+            buffer& operator=(buffer const&) = delete;
 
-            // Plain printable, the recursion ends here
-            if constexpr (is_plain_printable_v<T>)
+            ~buffer()
             {
-                p.out << arg;
+                if (_data != _inline)
+                {
+                    delete[] _data;
+                }
             }
-            else // Iterables except string
-            if constexpr (is_iterable_v<T> && !std::is_convertible_v<T, std::string>)
+
+            char const* data() const noexcept { return _data; }
+            std::size_t size() const noexcept { return _size; }
+            std::size_t capacity() const noexcept { return _capacity; }
+            void clear() noexcept { _size = 0; }
+            // Drop everything past the first size chars
+            void truncate(std::size_t size) noexcept { _size = std::min(_size, size); }
+
+            void push_back(char c)
             {
-                p.out << '[';
-                bool first = true;
-                for (const auto& item : arg)
+                if (_size == _capacity)
                 {
-                    if (!first)
-                    {
-                        p.out << ",";
-                    }
-                    first = false;
-                    _print(item, p);
+                    _grow(1);
                 }
-                p.out << ']';
+                _data[_size++] = c;
             }
-            else // Pair
-            if constexpr (is_pair_v<T>)
+
+            void append(char const* s, std::size_t n)
             {
-                p.out << '(';
-                _print(arg.first, arg.second, params{.sep=",", .end="", .out=p.out, .flush=false});
-                p.out << ')';
+                std::memcpy(reserve(n), s, n);
+                _size += n;
             }
-            else // Tuple
-            if constexpr (is_tuple_v<T>)
+
+            void append(std::string_view s)
             {
-                p.out << '(';
-                std::apply(
-                    [&](auto const&... elems)
-                    {
-                        bool first = true;
-                        ([&](auto const& elem)
-                         {
-                            if (!first)
-                            {
-                                p.out << ',';
-                            }
-                            _print(elem, p);
-                            first = false;
-                         }(elems), ...);
-                    }, arg);
-                p.out << ')';
+                append(s.data(), s.size());
             }
-            else // Bitset
-            if constexpr (is_bitset_v<T>)
+
+            // Make room for n more chars and return where they start; commit() what was written
+            char* reserve(std::size_t n)
+            {
+                if (n > _capacity - _size)
+                {
+                    _grow(n);
+                }
+                return _data + _size;
+            }
+
+            void commit(std::size_t n) noexcept
+            {
+                _size += n;
+            }
+
+            // Give heap storage back once it has grown past limit, so one huge print does not pin memory
+            void shrink(std::size_t limit) noexcept
+            {
+                if (_data != _inline && _capacity > limit)
+                {
+                    delete[] _data;
+                    _data = _inline;
+                    _capacity = sizeof(_inline);
+                }
+                _size = 0;
+            }
+
+        private:
+            void _grow(std::size_t n)
             {
-                p.out << arg.to_string();
+                std::size_t capacity = std::max(_capacity * 2, _size + n);
+                char* data = new char[capacity];
+                std::memcpy(data, _data, _size);
+                if (_data != _inline)
+                {
+                    delete[] _data;
+                }
+                _data = data;
+                _capacity = capacity;
             }
-            else // Container adapters
-            if constexpr (is_container_adapter_v<T>)
+
+            char _inline[256];
+            char* _data = _inline;
+            std::size_t _size = 0;
+            std::size_t _capacity = sizeof(_inline);
+        };
+
+        // Monotonic scratch memory for the temporaries of a print call. Allocation bumps a pointer;
+        // rewinding to an earlier position releases everything allocated since at once, and blocks are
+        // kept for the next call, so steady-state printing does not touch the heap.
+        class arena
+        {
+        public:
+            struct position
+            {
+                std::size_t block;
+                std::size_t used;
+            };
+
+            arena() = default;
+            arena(arena const&) = delete;
+            arena& operator=(arena const&) = delete;
+
+            // Uninitialized room for n objects; T must be trivially destructible, nothing is destroyed
+            template<typename T>
+            T* allocate(std::size_t n)
             {
-                T copy = arg; // Make a copy to preserve the original
-                p.out << '[';
-                bool first = true;
-                while (!copy.empty())
+                static_assert(std::is_trivially_destructible_v<T>, "Arena objects are never destroyed");
+                std::size_t const bytes = n * sizeof(T);
+                while (true)
                 {
-                    if (!first)
+                    if (_current == _blocks.size())
                     {
-                        p.out << ',';
+                        _add_block(bytes + alignof(T));
+                        continue;
                     }
-                    first = false;
-                    if constexpr (is_std_queue_v<T>)
-                    { // Queue uses front()
-                        _print(copy.front(), p);
+                    auto& b = _blocks[_current];
+                    auto const base = reinterpret_cast<std::uintptr_t>(b.data.get());
+                    std::size_t const offset = (base + _used + alignof(T) - 1) / alignof(T) * alignof(T) - base;
+                    if (offset + bytes <= b.size)
+                    {
+                        _used = offset + bytes;
+                        return reinterpret_cast<T*>(b.data.get() + offset);
                     }
-                    else
-                    { // Stack and priority_queue use top()
-                        _print(copy.top(), p);
+                    if (_current + 1 == _blocks.size())
+                    { // Later blocks are tried before the list grows
+                        _add_block(bytes + alignof(T));
                     }
-                    copy.pop();
+                    ++_current;
+                    _used = 0;
                 }
-                p.out << ']';
             }
-            else static_assert(false, "Object is not printable.");
 
-            // Print separator or end
-            if constexpr (sizeof...(args) > 1) // NOLINT(*-misleading-indentation)
+            position tell() const noexcept { return {_current, _used}; }
+
+            void rewind(position to) noexcept
             {
-                _print(p.sep, p);
-                _print(args...);
+                _current = to.block;
+                _used = to.used;
             }
-            else
+
+            // Free blocks past the first limit bytes; only valid when rewound to the start
+            void shrink(std::size_t limit)
             {
-                static_assert(std::is_same_v<std::tuple_element_t<0, std::tuple<Ts...>>, params>,
-                    "Last argument must be params, but it is not. Why?");
-                // print(std::get<0>(std::make_tuple(args...)));
+                std::size_t kept = 0;
+                std::size_t total = 0;
+                while (kept < _blocks.size() && total + _blocks[kept].size <= limit)
+                {
+                    total += _blocks[kept++].size;
+                }
+                _blocks.resize(kept);
             }
-        }
 
-    }
+        private:
+            struct block
+            {
+                std::unique_ptr<char[]> data;
+                std::size_t size;
+            };
 
-    template <typename T, typename... Ts>
-    void print(T const& arg, Ts const&... args)
-    {
-        if constexpr (sizeof...(args) > 0)
+            void _add_block(std::size_t bytes)
+            {
+                std::size_t const size = std::max({bytes, std::size_t(4096), _blocks.empty() ? 0 : 2 * _blocks.back().size});
+                _blocks.push_back(block{std::unique_ptr<char[]>(new char[size]), size});
+            }
+
+            std::vector<block> _blocks;
+            std::size_t _current = 0;
+            std::size_t _used = 0;
+        };
+
+        // Stream buffer appending to a buffer, so operator<< can still be used for anything the fast path skips
+        class buffer_streambuf: public std::streambuf
         {
-            // Check if the last argument is params
-            if constexpr (std::is_same_v<std::tuple_element_t<sizeof...(args) - 1, std::tuple<Ts...>>, params>)
+        public:
+            explicit buffer_streambuf(buffer& buf): _buf(buf) {}
+
+        protected:
+            int_type overflow(int_type ch) override
             {
-                details::_print(arg, args...);
-                print(std::get<sizeof...(args) - 1>(std::make_tuple(args...)));
+                if (!traits_type::eq_int_type(ch, traits_type::eof()))
+                {
+                    _buf.push_back(traits_type::to_char_type(ch));
+                }
+                return traits_type::not_eof(ch);
             }
-            else
+
+            std::streamsize xsputn(char const* s, std::streamsize n) override
+            {
+                _buf.append(s, static_cast<std::size_t>(n));
+                return n;
+            }
+
+        private:
+            buffer& _buf;
+        };
+
+        // Stream buffer that drops what is written, behind a stream kept only for its format state
+        class discard_streambuf: public std::streambuf
+        {
+        protected:
+            int_type overflow(int_type ch) override
             {
-                details::_print(arg, args..., params{});
-                print();
+                return traits_type::not_eof(ch);
             }
+
+            std::streamsize xsputn(char const*, std::streamsize n) override
+            {
+                return n;
+            }
+        };
+
+        inline discard_streambuf& _discard_streambuf()
+        {
+            static discard_streambuf discard;
+            return discard;
         }
-        else
+
+        struct alignas(64) padded_mutex
+        {
+            std::mutex mutex;
+        };
+
+        // Lock guarding writes to one stream; streams are spread over a fixed set of mutexes by address
+        inline std::mutex& stream_lock(std::ostream const& out)
+        {
+            static padded_mutex locks[64];
+            auto const address = reinterpret_cast<std::uintptr_t>(&out);
+            return locks[(address >> 6) % 64].mutex;
+        }
+
+        // Lock guarding a stream's format state (flags, width, locale) between print calls. Writes do not
+        // touch it, so it is never held across one; taken after stream_lock when both are needed.
+        inline std::mutex& format_lock(std::ostream const& out)
         {
-            details::_print(arg, params{});
-            print();
+            static padded_mutex locks[64];
+            auto const address = reinterpret_cast<std::uintptr_t>(&out);
+            return locks[(address >> 6) % 64].mutex;
         }
+
+        // Whether out formats numbers exactly like the classic "C" defaults, which to_chars reproduces
+        inline bool _has_default_format(std::ostream const& out)
+        {
+            constexpr auto ignored = std::ios_base::skipws | std::ios_base::unitbuf;
+            if ((out.flags() & ~ignored) != std::ios_base::dec || out.width() != 0 || out.precision() != 6)
+            {
+                return false;
+            }
+            auto const& np = std::use_facet<std::numpunct<char>>(out.getloc());
+            return np.decimal_point() == '.' && np.grouping().empty();
+        }
+
+        // State shared by every value formatted during one print call
+        class context
+        {
+        public:
+            // Values are formatted as format_source would format them (default formatting if null)
+            context(buffer& buf, arena& scratch, std::ostream const* format_source, params const& p):
+                context(buf, scratch, format_source, p, p.atomic) {}
+
+            // With shared_source, other threads may write to format_source while the line is formatted, so its
+            // format state is copied once, under its format_lock
+            context(buffer& buf, arena& scratch, std::ostream const* format_source, params const& p, bool shared_source):
+                context(buf, scratch, format_source, p, shared_source && format_source
+                    ? std::unique_lock<std::mutex>(format_lock(*format_source)) : std::unique_lock<std::mutex>()) {}
+
+            buffer& buf;
+            // Temporaries that live until the print call returns
+            arena& scratch;
+            // Format state is the default, so built-in types can bypass operator<<
+            bool const fast;
+            // Truncation limits from params, and how many containers deep formatting currently is
+            std::size_t const max_items;
+            std::size_t const edge_items;
+            std::size_t const max_depth;
+            std::size_t depth = 0;
+            bitset_format const bits;
+            // Threads large containers may be split across; 0 inside a chunk that is already parallel
+            unsigned parallel;
+            // Values are encoded as MessagePack rather than text; off while a formatter writes text
+            bool binary;
+
+            std::ostream const* format_source() const noexcept
+            {
+                return _source;
+            }
+
+            // Stream formatting into buf with the source's flags and locale, created on first use
+            std::ostream& stream()
+            {
+                if (!_stream)
+                {
+                    _streambuf.emplace(buf);
+                    _stream.emplace(&*_streambuf);
+                    if (_source)
+                    {
+                        _stream->copyfmt(*_source);
+                    }
+                }
+                return *_stream;
+            }
+
+            void put(char c)
+            {
+                if (fast)
+                {
+                    buf.push_back(c);
+                }
+                else
+                {
+                    stream() << c;
+                }
+            }
+
+            void write(char const* s)
+            {
+                if (fast)
+                {
+                    buf.append(std::string_view(s));
+                }
+                else
+                {
+                    stream() << s;
+                }
+            }
+
+            // Separator known at compile time: a fixed-size copy, no strlen
+            template <std::size_t N>
+            void write_literal(char const (&s)[N])
+            {
+                if (fast)
+                {
+                    buf.append(s, N - 1);
+                }
+                else
+                {
+                    stream() << s;
+                }
+            }
+
+            std::string_view view() const noexcept
+            {
+                return {buf.data(), buf.size()};
+            }
+
+            // Carry over what formatting through stream() did to the stream state
+            // Call with out's format_lock held where other threads print to it, and its stream_lock too if failed()
+            void sync_state(std::ostream& out)
+            {
+                if (_stream)
+                { // The first value already consumed the width, and failures belong to the real stream
+                    out.width(0);
+                    if (failed())
+                    {
+                        out.setstate(_stream->rdstate());
+                    }
+                }
+            }
+
+            // Formatting through stream() set a failure bit
+            bool failed() const noexcept
+            {
+                return _stream && !_stream->good();
+            }
+
+        private:
+            context(buffer& buf, arena& scratch, std::ostream const* format_source, params const& p,
+                    std::unique_lock<std::mutex> source_lock):
+                buf(buf), scratch(scratch), fast(!format_source || _has_default_format(*format_source)),
+                max_items(p.max_items), edge_items(p.edge_items), max_depth(p.max_depth), bits(p.bits),
+                parallel(p.parallel), binary(p.encode == encoding::msgpack), _source(format_source)
+            {
+                if (source_lock.owns_lock())
+                { // Nothing reads the shared stream after this
+                    if (fast)
+                    {
+                        _source = nullptr;
+                    }
+                    else
+                    {
+                        _snapshot.emplace(&_discard_streambuf());
+                        _snapshot->copyfmt(*format_source);
+                        _source = &*_snapshot;
+                    }
+                }
+            }
+
+            std::ostream const* _source;
+            // Format state of a shared source, copied while its lock was held
+            std::optional<std::ostream> _snapshot;
+            std::optional<buffer_streambuf> _streambuf;
+            std::optional<std::ostream> _stream;
+        };
+
+        struct thread_buffer
+        {
+            buffer buf;
+            arena scratch;
+            bool in_use = false;
+        };
+
+        inline thread_buffer& _thread_buffer()
+        {
+            thread_local thread_buffer tb;
+            return tb;
+        }
+
+        // Borrows the thread's buffer and scratch arena; a print nested inside a user operator<< gets a
+        // fresh buffer instead, and its scratch allocations are released when it returns
+        class buffer_lease
+        {
+        public:
+            // Heap storage above this is released after the call
+            static constexpr std::size_t retained_capacity = 1 << 20;
+
+            buffer_lease(): _tb(_thread_buffer()), _start(_tb.scratch.tell())
+            {
+                if (_tb.in_use)
+                {
+                    _nested.emplace();
+                }
+                else
+                {
+                    _tb.in_use = true;
+                }
+            }
+
+            ~buffer_lease()
+            {
+                _tb.scratch.rewind(_start);
+                if (!_nested)
+                {
+                    _tb.buf.shrink(retained_capacity);
+                    _tb.scratch.shrink(retained_capacity);
+                    _tb.in_use = false;
+                }
+            }
+
+            buffer_lease(buffer_lease const&) = delete;
+            buffer_lease& operator=(buffer_lease const&) = delete;
+
+            buffer& get()
+            {
+                return _nested ? *_nested : _tb.buf;
+            }
+
+            arena& scratch()
+            {
+                return _tb.scratch;
+            }
+
+        private:
+            thread_buffer& _tb;
+            arena::position const _start;
+            std::optional<buffer> _nested;
+        };
+
+    }
+
+    // Coalesces print output and writes it to the stream in batches: after every_n lines, once after_bytes
+    // are pending, when interval has passed since the last flush, or on flush()/flush_all(). With all
+    // thresholds at zero every line is flushed. Pending output is flushed when the policy is destroyed.
+    class flush_policy
+    {
+    public:
+        struct options
+        {
+            std::size_t every_n = 0;
+            std::size_t after_bytes = 0;
+            std::chrono::steady_clock::duration interval{};
+        };
+
+        flush_policy(): flush_policy(options{}) {}
+
+        explicit flush_policy(options opts): _opts(opts), _last_flush(std::chrono::steady_clock::now())
+        {
+            auto& r = _registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.policies.push_back(this);
+        }
+
+        ~flush_policy()
+        {
+            flush();
+            auto& r = _registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.policies.erase(std::find(r.policies.begin(), r.policies.end(), this));
+        }
+
+        flush_policy(flush_policy const&) = delete;
+        flush_policy& operator=(flush_policy const&) = delete;
+
+        // Queue bytes for out, writing and flushing the batch if a threshold is reached or flush_now is set
+        void write(std::ostream& out, std::string_view bytes, bool flush_now = false)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_out != &out)
+            { // Batches never mix streams
+                _flush_locked();
+                _out = &out;
+            }
+            _pending.append(bytes);
+            ++_lines;
+            auto now = std::chrono::steady_clock::now();
+            bool const unlimited = _opts.every_n == 0 && _opts.after_bytes == 0 && _opts.interval == _opts.interval.zero();
+            if (flush_now || unlimited
+                || (_opts.every_n != 0 && _lines >= _opts.every_n)
+                || (_opts.after_bytes != 0 && _pending.size() >= _opts.after_bytes)
+                || (_opts.interval != _opts.interval.zero() && now - _last_flush >= _opts.interval))
+            {
+                _flush_locked();
+                _last_flush = now;
+            }
+        }
+
+        // Write the pending batch and flush its stream
+        void flush()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _flush_locked();
+            _last_flush = std::chrono::steady_clock::now();
+        }
+
+    private:
+        friend void flush_all();
+
+        struct registry
+        {
+            std::mutex mutex;
+            std::vector<flush_policy*> policies;
+        };
+
+        static registry& _registry()
+        {
+            static registry r;
+            return r;
+        }
+
+        void _flush_locked()
+        {
+            if (_out)
+            {
+                std::lock_guard<std::mutex> lock(details::stream_lock(*_out));
+                _out->write(_pending.data(), static_cast<std::streamsize>(_pending.size()));
+                _out->flush();
+            }
+            _pending.shrink(details::buffer_lease::retained_capacity);
+            _lines = 0;
+        }
+
+        options const _opts;
+        std::mutex _mutex;
+        details::buffer _pending;
+        std::ostream* _out = nullptr;
+        std::size_t _lines = 0;
+        std::chrono::steady_clock::time_point _last_flush;
+    };
+
+    // Flush the pending output of every live flush_policy
+    inline void flush_all()
+    {
+        auto& r = flush_policy::_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (auto* policy : r.policies)
+        {
+            policy->flush();
+        }
+    }
+
+    // Destination for whole formatted lines that is not an ostream, selected with params::to
+    class sink
+    {
+    public:
+        virtual ~sink() = default;
+
+        // Take one complete line; may be called from several threads at once
+        virtual void write(char const* data, std::size_t size) = 0;
+        // Push out anything the sink is holding back
+        virtual void flush() {}
+    };
+
+#if defined(PYPRINT_HAS_POSIX)
+    // Writes to a file descriptor in page-aligned batches of batch_size bytes, bypassing the extra
+    // buffer of std::ofstream. Every write but the last is a full batch. Errors stop all further
+    // output and are reported by good(), like a stream's failbit.
+    class fd_sink: public sink
+    {
+    public:
+        static constexpr std::size_t default_batch_size = std::size_t(1) << 20;
+
+        // Write to fd, which stays open and owned by the caller
+        explicit fd_sink(int fd, std::size_t batch_size = default_batch_size): fd_sink(fd, false, batch_size) {}
+
+        // Create or truncate the file at path
+        explicit fd_sink(char const* path, std::size_t batch_size = default_batch_size):
+            fd_sink(::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644), true, batch_size) {}
+
+        ~fd_sink() override
+        {
+            flush();
+            if (_owned && _fd >= 0)
+            {
+                ::close(_fd);
+            }
+            ::operator delete(_batch, std::align_val_t(_alignment));
+        }
+
+        fd_sink(fd_sink const&) = delete;
+        fd_sink& operator=(fd_sink const&) = delete;
+
+        void write(char const* data, std::size_t size) override
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            while (size != 0)
+            {
+                std::size_t const n = std::min(size, _batch_size - _pending);
+                std::memcpy(_batch + _pending, data, n);
+                _pending += n;
+                data += n;
+                size -= n;
+                if (_pending == _batch_size)
+                {
+                    _write_batch();
+                }
+            }
+        }
+
+        void flush() override
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _write_batch();
+        }
+
+        // False once opening or writing has failed
+        bool good() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return !_failed;
+        }
+
+    private:
+        static constexpr std::size_t _alignment = 4096;
+
+        fd_sink(int fd, bool owned, std::size_t batch_size):
+            _fd(fd), _owned(owned), _failed(fd < 0),
+            _batch_size((std::max(batch_size, _alignment) + _alignment - 1) / _alignment * _alignment),
+            _batch(static_cast<char*>(::operator new(_batch_size, std::align_val_t(_alignment)))) {}
+
+        void _write_batch()
+        {
+            char const* data = _batch;
+            std::size_t size = _pending;
+            _pending = 0;
+            while (size != 0 && !_failed)
+            {
+                ssize_t const n = ::write(_fd, data, size);
+                if (n < 0)
+                {
+                    _failed = errno != EINTR;
+                    continue;
+                }
+                data += n;
+                size -= static_cast<std::size_t>(n);
+            }
+        }
+
+        int const _fd;
+        bool const _owned;
+        bool _failed;
+        std::size_t const _batch_size;
+        char* const _batch;
+        std::size_t _pending = 0;
+        mutable std::mutex _mutex;
+    };
+
+    // Writes into a shared memory mapping of a file, so lines reach the page cache with a single copy
+    // and no system call per batch. The file and mapping double when full, by at least chunk_size bytes,
+    // so a large dump is remapped only a logarithmic number of times. The file is cut back to the bytes
+    // written when the sink is destroyed, and until then readers may see a zero-filled tail. Errors stop
+    // all further output and are reported by good().
+    class mmap_sink: public sink
+    {
+    public:
+        static constexpr std::size_t default_chunk_size = std::size_t(8) << 20;
+
+        // Create or truncate the file at path
+        explicit mmap_sink(char const* path, std::size_t chunk_size = default_chunk_size):
+            _fd(::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)), _failed(_fd < 0),
+            _chunk_size(std::max<std::size_t>(chunk_size, 1)) {}
+
+        ~mmap_sink() override
+        {
+            _unmap();
+            if (_fd >= 0)
+            {
+                static_cast<void>(::ftruncate(_fd, static_cast<off_t>(_size)));
+                ::close(_fd);
+            }
+        }
+
+        mmap_sink(mmap_sink const&) = delete;
+        mmap_sink& operator=(mmap_sink const&) = delete;
+
+        void write(char const* data, std::size_t size) override
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_failed || (_size + size > _mapped && !_grow(_size + size)))
+            {
+                return;
+            }
+            std::memcpy(_map + _size, data, size);
+            _size += size;
+        }
+
+        // False once opening, growing or mapping the file has failed
+        bool good() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return !_failed;
+        }
+
+        // Bytes written so far
+        std::size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _size;
+        }
+
+    private:
+        bool _grow(std::size_t needed)
+        {
+            auto const page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+            std::size_t mapped = std::max(needed, 2 * _mapped);
+            mapped = (mapped + _chunk_size - 1) / _chunk_size * _chunk_size;
+            mapped = (mapped + page - 1) / page * page;
+            void* map = MAP_FAILED;
+            if (::ftruncate(_fd, static_cast<off_t>(mapped)) == 0)
+            {
+#if defined(__linux__)
+                map = _map ? ::mremap(_map, _mapped, mapped, MREMAP_MAYMOVE)
+                           : ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+#else
+                _unmap();
+                map = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+#endif
+            }
+            if (map == MAP_FAILED)
+            {
+                _failed = true;
+                return false;
+            }
+#if defined(MADV_POPULATE_WRITE)
+            // Fault the new pages in with one call instead of one fault per page as they are written
+            static_cast<void>(::madvise(static_cast<char*>(map) + _mapped, mapped - _mapped, MADV_POPULATE_WRITE));
+#endif
+            _map = static_cast<char*>(map);
+            _mapped = mapped;
+            return true;
+        }
+
+        void _unmap()
+        {
+            if (_map)
+            {
+                ::munmap(_map, _mapped);
+                _map = nullptr;
+                _mapped = 0;
+            }
+        }
+
+        int const _fd;
+        bool _failed;
+        std::size_t const _chunk_size;
+        char* _map = nullptr;
+        std::size_t _mapped = 0;
+        std::size_t _size = 0;
+        mutable std::mutex _mutex;
+    };
+#endif
+
+    class call_site;
+
+    namespace details
+    {
+        call_site& _overflow_site() noexcept;
+    }
+
+    // A place print is called from, declared once per call site by PYPRINT_PRINT
+    class call_site
+    {
+    public:
+        call_site(char const* file, unsigned line, char const* function) noexcept;
+        call_site(call_site const&) = delete;
+        call_site& operator=(call_site const&) = delete;
+
+        char const* const file;
+        unsigned const line;
+        char const* const function;
+        // Dense index into the per-thread counters
+        std::size_t const id;
+        // Every site is in one list, newest first
+        call_site* next = nullptr;
+
+    private:
+        friend call_site& details::_overflow_site() noexcept;
+
+        call_site(char const* file, unsigned line, char const* function, std::size_t id) noexcept;
+
+        void _link() noexcept;
+    };
+
+    // What PYPRINT_STATS recorded for one call site, summed over all threads
+    struct site_stats
+    {
+        // Histogram bucket i counts calls that took less than 2^i ns in all
+        static constexpr std::size_t buckets = 40;
+
+        char const* file;
+        unsigned line;
+        char const* function;
+        std::uint64_t calls = 0;
+        std::uint64_t bytes = 0;
+        std::uint64_t format_ns = 0;
+        std::uint64_t write_ns = 0;
+        std::uint64_t largest_container = 0;
+        std::uint64_t latency[buckets] = {};
+
+        // Upper bound in ns of the latency below which fraction q of the calls finished
+        std::uint64_t percentile(double q) const noexcept
+        {
+            auto const wanted = static_cast<std::uint64_t>(q * static_cast<double>(calls));
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < buckets; ++i)
+            {
+                seen += latency[i];
+                if (seen > wanted || (seen == calls && seen != 0))
+                {
+                    return std::uint64_t(1) << i;
+                }
+            }
+            return 0;
+        }
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, site_stats const& s)
+    {
+        return os << s.file << ':' << s.line << " (" << s.function << ") calls=" << s.calls << " bytes=" << s.bytes
+                  << " format=" << s.format_ns / 1000 << "us write=" << s.write_ns / 1000 << "us largest="
+                  << s.largest_container << " p50<" << s.percentile(0.5) << "ns p99<" << s.percentile(0.99) << "ns";
+    }
+
+    namespace details
+    {
+        // Sites beyond this are counted together under _overflow_site(), which takes the last id
+        inline constexpr std::size_t _max_sites = 4096;
+        inline constexpr std::size_t _overflow_id = _max_sites - 1;
+
+        inline std::atomic<call_site*>& _site_list() noexcept
+        {
+            static std::atomic<call_site*> head{nullptr};
+            return head;
+        }
+
+        inline std::size_t _next_site_id() noexcept
+        {
+            static std::atomic<std::size_t> count{0};
+            return std::min(count.fetch_add(1, std::memory_order_relaxed), _overflow_id);
+        }
+
+        inline call_site& _overflow_site() noexcept
+        {
+            static call_site site("(overflow)", 0, "print", _overflow_id);
+            return site;
+        }
+    }
+
+    inline call_site::call_site(char const* file, unsigned line, char const* function) noexcept:
+        file(file), line(line), function(function), id(details::_next_site_id())
+    {
+        // Only the shared site is listed for the overflow id, so stats() reports its counters once
+        if (id == details::_overflow_id)
+        {
+            details::_overflow_site();
+            return;
+        }
+        _link();
+    }
+
+    inline call_site::call_site(char const* file, unsigned line, char const* function, std::size_t id) noexcept:
+        file(file), line(line), function(function), id(id)
+    {
+        _link();
+    }
+
+    inline void call_site::_link() noexcept
+    {
+        auto& head = details::_site_list();
+        next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+#if defined(PYPRINT_STATS)
+    namespace details
+    {
+        // One thread's counters for one site. Only the owning thread writes them, so plain relaxed
+        // load/store pairs suffice; stats() reads them while they change.
+        struct _site_counters
+        {
+            std::atomic<std::uint64_t> calls{0};
+            std::atomic<std::uint64_t> bytes{0};
+            std::atomic<std::uint64_t> format_ns{0};
+            std::atomic<std::uint64_t> write_ns{0};
+            std::atomic<std::uint64_t> largest{0};
+            std::atomic<std::uint64_t> latency[site_stats::buckets] = {};
+
+            static void add(std::atomic<std::uint64_t>& counter, std::uint64_t n) noexcept
+            {
+                counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+        };
+
+        // Counters of the threads that use it, one at a time; a thread takes a free shard when it starts
+        // printing and frees it when it exits. Shards are never deleted, so their counts keep adding up.
+        class _stats_shard
+        {
+        public:
+            static constexpr std::size_t chunk = 64;
+
+            // Counters for a site, allocated 64 sites at a time on first use
+            _site_counters& at(std::size_t id)
+            {
+                auto& slot = _chunks[id / chunk];
+                _site_counters* counters = slot.load(std::memory_order_relaxed);
+                if (!counters)
+                {
+                    counters = new _site_counters[chunk];
+                    slot.store(counters, std::memory_order_release);
+                }
+                return counters[id % chunk];
+            }
+
+            _site_counters const* find(std::size_t id) const noexcept
+            {
+                _site_counters const* counters = _chunks[id / chunk].load(std::memory_order_acquire);
+                return counters ? counters + id % chunk : nullptr;
+            }
+
+            std::atomic<bool> in_use{true};
+            _stats_shard* next = nullptr;
+
+        private:
+            std::atomic<_site_counters*> _chunks[_max_sites / chunk] = {};
+        };
+
+        inline std::atomic<_stats_shard*>& _shard_list() noexcept
+        {
+            static std::atomic<_stats_shard*> head{nullptr};
+            return head;
+        }
+
+        // The calling thread's shard, claimed from the free ones or added to the list
+        class _shard_lease
+        {
+        public:
+            _shard_lease()
+            {
+                auto& head = _shard_list();
+                for (_stats_shard* s = head.load(std::memory_order_acquire); s; s = s->next)
+                {
+                    bool free = false;
+                    if (s->in_use.compare_exchange_strong(free, true, std::memory_order_acquire))
+                    {
+                        shard = s;
+                        return;
+                    }
+                }
+                shard = new _stats_shard;
+                shard->next = head.load(std::memory_order_relaxed);
+                while (!head.compare_exchange_weak(shard->next, shard, std::memory_order_release, std::memory_order_relaxed))
+                {
+                }
+            }
+
+            ~_shard_lease()
+            {
+                shard->in_use.store(false, std::memory_order_release);
+            }
+
+            _stats_shard* shard;
+        };
+
+        // The call site the next print on this thread is attributed to, and the largest container it printed
+        struct _stats_thread
+        {
+            call_site* site = nullptr;
+            std::size_t largest = 0;
+        };
+
+        inline _stats_thread& _stats_local() noexcept
+        {
+            thread_local _stats_thread local;
+            return local;
+        }
+
+        inline call_site& _unattributed_site() noexcept
+        {
+            static call_site site("(unattributed)", 0, "print");
+            return site;
+        }
+
+        // Times one print call from construction: formatted() marks the end of formatting, and the
+        // destructor the end of the write, when the call is added to its site's counters
+        class _call_stats
+        {
+        public:
+            _call_stats() noexcept:
+                _start(std::chrono::steady_clock::now())
+            {
+                _stats_local().largest = 0;
+            }
+
+            void formatted(std::size_t bytes) noexcept
+            {
+                _formatted = std::chrono::steady_clock::now();
+                _bytes = bytes;
+            }
+
+            ~_call_stats()
+            {
+                thread_local _shard_lease lease;
+                auto const end = std::chrono::steady_clock::now();
+                auto const ns = [](auto d) { return static_cast<std::uint64_t>(std::chrono::nanoseconds(d).count()); };
+                _stats_thread& local = _stats_local();
+                call_site const& site = local.site ? *local.site : _unattributed_site();
+                _site_counters& c = lease.shard->at(site.id);
+                std::uint64_t const total = ns(end - _start);
+                std::size_t bucket = 0;
+                while (bucket + 1 < site_stats::buckets && total >= (std::uint64_t(1) << bucket))
+                {
+                    ++bucket;
+                }
+                _site_counters::add(c.calls, 1);
+                _site_counters::add(c.bytes, _bytes);
+                _site_counters::add(c.format_ns, ns(_formatted - _start));
+                _site_counters::add(c.write_ns, ns(end - _formatted));
+                _site_counters::add(c.latency[bucket], 1);
+                if (local.largest > c.largest.load(std::memory_order_relaxed))
+                {
+                    c.largest.store(local.largest, std::memory_order_relaxed);
+                }
+            }
+
+        private:
+            std::chrono::steady_clock::time_point const _start;
+            std::chrono::steady_clock::time_point _formatted = _start;
+            std::size_t _bytes = 0;
+        };
+
+        inline void _stats_container(std::ptrdiff_t count) noexcept
+        {
+            auto& largest = _stats_local().largest;
+            largest = std::max(largest, static_cast<std::size_t>(count < 0 ? 0 : count));
+        }
+
+        // Attributes the prints made while it lives to a call site
+        class _site_scope
+        {
+        public:
+            explicit _site_scope(call_site& site) noexcept:
+                _previous(std::exchange(_stats_local().site, &site)) {}
+
+            ~_site_scope()
+            {
+                _stats_local().site = _previous;
+            }
+
+        private:
+            call_site* _previous;
+        };
+    }
+
+    // Counters of every call site that has printed, summed over the threads, busiest (by bytes) first.
+    // Reading them does not stop other threads from printing.
+    inline std::vector<site_stats> stats()
+    {
+        std::vector<site_stats> result;
+        for (call_site* site = details::_site_list().load(std::memory_order_acquire); site; site = site->next)
+        {
+            site_stats s{site->file, site->line, site->function};
+            for (auto* shard = details::_shard_list().load(std::memory_order_acquire); shard; shard = shard->next)
+            {
+                if (auto const* c = shard->find(site->id))
+                {
+                    auto const load = [](std::atomic<std::uint64_t> const& n) { return n.load(std::memory_order_relaxed); };
+                    s.calls += load(c->calls);
+                    s.bytes += load(c->bytes);
+                    s.format_ns += load(c->format_ns);
+                    s.write_ns += load(c->write_ns);
+                    s.largest_container = std::max(s.largest_container, load(c->largest));
+                    for (std::size_t i = 0; i < site_stats::buckets; ++i)
+                    {
+                        s.latency[i] += load(c->latency[i]);
+                    }
+                }
+            }
+            if (s.calls != 0)
+            {
+                result.push_back(s);
+            }
+        }
+        std::sort(result.begin(), result.end(),
+            [](site_stats const& a, site_stats const& b) { return a.bytes > b.bytes; });
+        return result;
+    }
+
+    // print(...) counted under this call site in stats()
+#define PYPRINT_PRINT(...) \
+    do \
+    { \
+        static ::pyprint::call_site pyprint_site_(__FILE__, __LINE__, __func__); \
+        ::pyprint::details::_site_scope const pyprint_scope_(pyprint_site_); \
+        ::pyprint::print(__VA_ARGS__); \
+    } while (false)
+#else
+    namespace details
+    {
+        // Without PYPRINT_STATS nothing is recorded and these compile away
+        struct _call_stats
+        {
+            void formatted(std::size_t) noexcept {}
+        };
+
+        inline void _stats_container(std::ptrdiff_t) noexcept {}
+    }
+
+    // Nothing is recorded without PYPRINT_STATS
+    inline std::vector<site_stats> stats()
+    {
+        return {};
+    }
+
+#define PYPRINT_PRINT(...) ::pyprint::print(__VA_ARGS__)
+#endif
+
+    namespace details
+    {
+        // Reaches the protected members of a container adapter without copying it
+        template<typename Adapter>
+        struct adapter_access: Adapter
+        {
+            static typename Adapter::container_type const& container(Adapter const& a)
+            {
+                return a.*(&adapter_access::c);
+            }
+
+            static auto const& compare(Adapter const& a)
+            {
+                return a.*(&adapter_access::comp);
+            }
+        };
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        inline constexpr bool _little_endian = false;
+#else
+        inline constexpr bool _little_endian = true;
+#endif
+
+        // libstdc++, libc++ and MSVC keep a bitset as an array of unsigned words, lowest bits first,
+        // so on little-endian targets byte k of the object holds bits 8k to 8k+7
+        template<std::size_t N>
+        inline constexpr bool _bitset_bytes_readable =
+#if defined(__GLIBCXX__) || defined(_LIBCPP_VERSION) || defined(_MSC_VER)
+            _little_endian && sizeof(std::bitset<N>) * CHAR_BIT >= N;
+#else
+            false;
+#endif
+
+        // Bits 8k to 8k+7 of a bitset
+        template<std::size_t N>
+        unsigned _bitset_byte(std::bitset<N> const& bits, std::size_t k) noexcept
+        {
+            if constexpr (_bitset_bytes_readable<N>)
+            {
+                return reinterpret_cast<unsigned char const*>(&bits)[k];
+            }
+            else
+            {
+                unsigned byte = 0;
+                for (std::size_t i = 8 * k; i < N && i < 8 * k + 8; ++i)
+                {
+                    byte |= static_cast<unsigned>(bits[i]) << (i - 8 * k);
+                }
+                return byte;
+            }
+        }
+
+        // The 8 bits of a byte as '0'/'1' characters, most significant first: spread the byte over all
+        // 8 lanes, keep a different bit in each lane, then turn the nonzero lanes into 1
+        inline void _write_bits8(char* out, unsigned byte) noexcept
+        {
+            constexpr std::uint64_t select = _little_endian ? 0x0102040810204080 : 0x8040201008040201;
+            std::uint64_t const lanes = (static_cast<std::uint64_t>(byte) * 0x0101010101010101) & select;
+            std::uint64_t const chars = (((lanes + 0x7F7F7F7F7F7F7F7F) & 0x8080808080808080) >> 7) | 0x3030303030303030;
+            std::memcpy(out, &chars, 8);
+        }
+
+#if defined(PYPRINT_HAS_SSE2)
+        // Same for 16 bits at once: both bytes are spread over 8 lanes each and compared with the bit masks
+        inline void _write_bits16(char* out, unsigned high, unsigned low) noexcept
+        {
+            __m128i const lanes = _mm_set_epi64x(
+                static_cast<long long>(low * 0x0101010101010101ull), static_cast<long long>(high * 0x0101010101010101ull));
+            __m128i const select = _mm_set1_epi64x(0x0102040810204080);
+            __m128i const set = _mm_cmpeq_epi8(_mm_and_si128(lanes, select), select);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_sub_epi8(_mm_set1_epi8('0'), set));
+        }
+#else
+        inline void _write_bits16(char* out, unsigned high, unsigned low) noexcept
+        {
+            _write_bits8(out, high);
+            _write_bits8(out + 8, low);
+        }
+#endif
+
+        // Render a bitset into buf without building a string, highest bit first
+        template<std::size_t N>
+        void _append_bitset(buffer& buf, std::bitset<N> const& bits, bitset_format format)
+        {
+            constexpr std::size_t whole = N / 8; // Complete bytes, below the N % 8 bits of a partial top byte
+            if (format == bitset_format::hex)
+            {
+                constexpr std::size_t digits = (N + 3) / 4;
+                char* const first = buf.reserve(digits + 2);
+                first[0] = '0';
+                first[1] = 'x';
+                char* out = first + 2;
+                for (std::size_t d = digits; d-- > 0;)
+                {
+                    *out++ = "0123456789abcdef"[(_bitset_byte(bits, d / 2) >> (4 * (d % 2))) & 0xF];
+                }
+                buf.commit(digits + 2);
+            }
+            else if (format == bitset_format::grouped)
+            {
+                constexpr std::size_t size = N == 0 ? 0 : N + (N - 1) / 4;
+                char* const first = buf.reserve(size + 8);
+                char* out = first;
+                for (std::size_t i = N; i-- > 8 * whole;)
+                {
+                    *out++ = bits[i] ? '1' : '0';
+                    if (i % 4 == 0)
+                    {
+                        *out++ = '_';
+                    }
+                }
+                for (std::size_t k = whole; k-- > 0;)
+                {
+                    char chars[8];
+                    _write_bits8(chars, _bitset_byte(bits, k));
+                    std::memcpy(out, chars, 4);
+                    out[4] = '_';
+                    std::memcpy(out + 5, chars + 4, 4);
+                    out[9] = '_';
+                    out += 10;
+                }
+                buf.commit(size);
+            }
+            else
+            {
+                char* const first = buf.reserve(N + 16);
+                char* out = first;
+                for (std::size_t i = N; i-- > 8 * whole;)
+                {
+                    *out++ = bits[i] ? '1' : '0';
+                }
+                std::size_t k = whole;
+                for (; k >= 2; k -= 2, out += 16)
+                {
+                    _write_bits16(out, _bitset_byte(bits, k - 1), _bitset_byte(bits, k - 2));
+                }
+                if (k == 1)
+                {
+                    _write_bits8(out, _bitset_byte(bits, 0));
+                }
+                buf.commit(N);
+            }
+        }
+
+        // A string-like value that is a null pointer; character arrays never are, and are not compared
+        template<typename T>
+        bool _is_null_string(T const& arg) noexcept
+        {
+            if constexpr (std::is_pointer_v<T>)
+            {
+                return arg == nullptr;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        // Print a value operator<< accepts, formatting built-in types directly when the stream state allows
+        template<typename T>
+        void _print_plain(context& ctx, T const& arg)
+        {
+            if (ctx.fast)
+            {
+                if constexpr (is_string_like_v<T>)
+                {
+                    if (_is_null_string(arg))
+                    { // Leave the null pointer error to the stream
+                        ctx.stream() << arg;
+                        return;
+                    }
+                    ctx.buf.append(std::string_view(arg));
+                    return;
+                }
+                else if constexpr (is_character_v<T>)
+                {
+                    ctx.buf.push_back(static_cast<char>(arg));
+                    return;
+                }
+                else if constexpr (std::is_same_v<T, bool>)
+                {
+                    ctx.buf.push_back(arg ? '1' : '0');
+                    return;
+                }
+                else if constexpr (std::is_integral_v<T> && sizeof(T) <= sizeof(long long))
+                {
+                    using wide = std::conditional_t<std::is_signed_v<T>, long long, unsigned long long>;
+                    char* first = ctx.buf.reserve(24);
+                    ctx.buf.commit(static_cast<std::size_t>(
+                        std::to_chars(first, first + 24, static_cast<wide>(arg)).ptr - first));
+                    return;
+                }
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+                else if constexpr (std::is_floating_point_v<T>)
+                { // Default stream formatting is printf's %g with precision 6
+                    char* first = ctx.buf.reserve(32);
+                    ctx.buf.commit(static_cast<std::size_t>(
+                        std::to_chars(first, first + 32, arg, std::chars_format::general, 6).ptr - first));
+                    return;
+                }
+#endif
+            }
+            if constexpr (is_bitset_v<T>)
+            {
+                if (ctx.fast)
+                {
+                    _append_bitset(ctx.buf, arg, ctx.bits);
+                    return;
+                }
+                if (ctx.bits != bitset_format::binary)
+                { // Still padded to the stream's width like any other value
+                    buffer rendered;
+                    _append_bitset(rendered, arg, ctx.bits);
+                    ctx.stream() << std::string_view(rendered.data(), rendered.size());
+                    return;
+                }
+            }
+            ctx.stream() << arg;
+        }
+
+        inline constexpr char _digit_pairs[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+
+        // Write v < 10000 without leading zeros
+        inline char* _write_small(char* out, std::uint32_t v) noexcept
+        {
+            if (v < 10)
+            {
+                *out = static_cast<char>('0' + v);
+                return out + 1;
+            }
+            if (v < 100)
+            {
+                std::memcpy(out, _digit_pairs + 2 * v, 2);
+                return out + 2;
+            }
+            if (v < 1000)
+            {
+                *out = static_cast<char>('0' + v / 100);
+                std::memcpy(out + 1, _digit_pairs + 2 * (v % 100), 2);
+                return out + 3;
+            }
+            std::memcpy(out, _digit_pairs + 2 * (v / 100), 2);
+            std::memcpy(out + 2, _digit_pairs + 2 * (v % 100), 2);
+            return out + 4;
+        }
+
+#if defined(PYPRINT_HAS_SSE2)
+        // The 8 decimal digits of v < 10^8 as 8 ASCII bytes in a register, most significant first.
+        // Both 4-digit halves are divided by 1000, 100, 10 and 1 at once with 16-bit multiply-high
+        // steps (x * 4 keeps enough precision), and digit = quotient - 10 * next larger quotient.
+        inline __m128i _digits8_sse2(std::uint32_t v) noexcept
+        {
+            std::uint32_t const high = v / 10000;
+            std::uint32_t const low = v - high * 10000;
+            __m128i const halves = _mm_set_epi16(
+                static_cast<short>(low), static_cast<short>(low), static_cast<short>(low), static_cast<short>(low),
+                static_cast<short>(high), static_cast<short>(high), static_cast<short>(high), static_cast<short>(high));
+            __m128i const divide = _mm_setr_epi16(8389, 5243, 3277, -32768, 8389, 5243, 3277, -32768);
+            __m128i const shift = _mm_setr_epi16(128, 2048, -32768, -32768, 128, 2048, -32768, -32768);
+            __m128i const quotients = _mm_mulhi_epu16(_mm_mulhi_epu16(_mm_slli_epi16(halves, 2), divide), shift);
+            __m128i const tens = _mm_slli_epi64(_mm_mullo_epi16(quotients, _mm_set1_epi16(10)), 16);
+            __m128i const digits = _mm_packus_epi16(_mm_sub_epi16(quotients, tens), _mm_setzero_si128());
+            return _mm_add_epi8(digits, _mm_set1_epi8('0'));
+        }
+
+        // Write exactly 8 digits of v < 10^8, with leading zeros
+        inline char* _write_digits8(char* out, std::uint32_t v) noexcept
+        {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _digits8_sse2(v));
+            return out + 8;
+        }
+
+        // Write v < 10^8 without leading zeros; may store up to 8 bytes past the result
+        inline char* _write_upto8(char* out, std::uint32_t v) noexcept
+        {
+            if (v < 10000)
+            {
+                return _write_small(out, v);
+            }
+            __m128i const ascii = _digits8_sse2(v);
+            auto const zeros = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(ascii, _mm_set1_epi8('0'))));
+            unsigned leading = 0;
+            while (zeros & (1u << leading))
+            {
+                ++leading;
+            }
+            std::uint64_t bytes;
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(&bytes), ascii);
+            bytes >>= 8 * leading; // little-endian: drops the leading zero characters
+            std::memcpy(out, &bytes, 8);
+            return out + 8 - leading;
+        }
+#else
+        inline char* _write_digits8(char* out, std::uint32_t v) noexcept
+        {
+            std::uint32_t const high = v / 10000;
+            std::uint32_t const low = v - high * 10000;
+            std::memcpy(out, _digit_pairs + 2 * (high / 100), 2);
+            std::memcpy(out + 2, _digit_pairs + 2 * (high % 100), 2);
+            std::memcpy(out + 4, _digit_pairs + 2 * (low / 100), 2);
+            std::memcpy(out + 6, _digit_pairs + 2 * (low % 100), 2);
+            return out + 8;
+        }
+
+        inline char* _write_upto8(char* out, std::uint32_t v) noexcept
+        {
+            if (v < 10000)
+            {
+                return _write_small(out, v);
+            }
+            std::uint32_t const high = v / 10000;
+            std::uint32_t const low = v - high * 10000;
+            out = _write_small(out, high);
+            std::memcpy(out, _digit_pairs + 2 * (low / 100), 2);
+            std::memcpy(out + 2, _digit_pairs + 2 * (low % 100), 2);
+            return out + 4;
+        }
+#endif
+
+        inline char* _write_u64(char* out, std::uint64_t v) noexcept
+        {
+            if (v < 100000000)
+            {
+                return _write_upto8(out, static_cast<std::uint32_t>(v));
+            }
+            if (v < 10000000000000000)
+            {
+                out = _write_upto8(out, static_cast<std::uint32_t>(v / 100000000));
+                return _write_digits8(out, static_cast<std::uint32_t>(v % 100000000));
+            }
+            out = _write_small(out, static_cast<std::uint32_t>(v / 10000000000000000));
+            out = _write_digits8(out, static_cast<std::uint32_t>(v / 100000000 % 100000000));
+            return _write_digits8(out, static_cast<std::uint32_t>(v % 100000000));
+        }
+
+        // Append values as one comma-joined run, formatted the way default ostream formatting would.
+        // Room for a whole block is reserved at once, so the inner loop has no bounds checks.
+        template <typename T>
+        void _append_numbers(buffer& buf, T const* values, std::size_t n)
+        {
+            constexpr std::size_t width = std::is_floating_point_v<T> ? 32 : std::numeric_limits<T>::digits10 + 3;
+            constexpr std::size_t block = 1024;
+            for (std::size_t start = 0; start < n; start += block)
+            {
+                std::size_t const stop = std::min(n, start + block);
+                char* const first = buf.reserve((stop - start) * (width + 1) + 16);
+                char* out = first;
+                for (std::size_t i = start; i < stop; ++i)
+                {
+                    if (i != 0)
+                    {
+                        *out++ = ',';
+                    }
+                    T const v = values[i];
+                    if constexpr (is_character_v<T>)
+                    {
+                        *out++ = static_cast<char>(v);
+                    }
+                    else if constexpr (std::is_same_v<T, bool>)
+                    {
+                        *out++ = v ? '1' : '0';
+                    }
+                    else if constexpr (std::is_floating_point_v<T>)
+                    {
+                        out = std::to_chars(out, out + width, v, std::chars_format::general, 6).ptr;
+                    }
+                    else if constexpr (std::is_signed_v<T>)
+                    {
+                        auto magnitude = static_cast<std::uint64_t>(v);
+                        if (v < 0)
+                        {
+                            *out++ = '-';
+                            magnitude = 0 - magnitude;
+                        }
+                        out = _write_u64(out, magnitude);
+                    }
+                    else
+                    {
+                        out = _write_u64(out, v);
+                    }
+                }
+                buf.commit(static_cast<std::size_t>(out - first));
+            }
+        }
+
+
+        // MessagePack encoding. Multi-byte lengths and numbers are big-endian; typed arrays keep the
+        // elements little-endian so that they can be copied as they are in memory.
+        inline void _pack_be(buffer& buf, unsigned char tag, std::uint64_t v, std::size_t bytes)
+        {
+            char* out = buf.reserve(1 + bytes);
+            out[0] = static_cast<char>(tag);
+            for (std::size_t i = 0; i < bytes; ++i)
+            {
+                out[bytes - i] = static_cast<char>(v >> (8 * i));
+            }
+            buf.commit(1 + bytes);
+        }
+
+        inline void _pack_array_header(buffer& buf, std::size_t n)
+        {
+            if (n < 16)
+            {
+                buf.push_back(static_cast<char>(0x90 | n));
+            }
+            else if (n <= 0xffff)
+            {
+                _pack_be(buf, 0xdc, n, 2);
+            }
+            else
+            {
+                _pack_be(buf, 0xdd, n, 4);
+            }
+        }
+
+        // A 32-bit header for an array or str whose length is only known once it is written; returns
+        // where it starts, for _pack_patch
+        inline std::size_t _pack_placeholder(buffer& buf, unsigned char tag)
+        {
+            std::size_t const at = buf.size();
+            _pack_be(buf, tag, 0, 4);
+            return at;
+        }
+
+        inline void _pack_patch(buffer& buf, std::size_t at, std::size_t n)
+        {
+            char* out = const_cast<char*>(buf.data()) + at + 1;
+            for (std::size_t i = 0; i < 4; ++i)
+            {
+                out[3 - i] = static_cast<char>(n >> (8 * i));
+            }
+        }
+
+        inline void _pack_string(buffer& buf, std::string_view s)
+        {
+            if (s.size() < 32)
+            {
+                buf.push_back(static_cast<char>(0xa0 | s.size()));
+            }
+            else if (s.size() <= 0xff)
+            {
+                _pack_be(buf, 0xd9, s.size(), 1);
+            }
+            else if (s.size() <= 0xffff)
+            {
+                _pack_be(buf, 0xda, s.size(), 2);
+            }
+            else
+            {
+                _pack_be(buf, 0xdb, s.size(), 4);
+            }
+            buf.append(s);
+        }
+
+        // Integers take the smallest form that holds them
+        inline void _pack_unsigned(buffer& buf, std::uint64_t v)
+        {
+            if (v < 0x80)
+            {
+                buf.push_back(static_cast<char>(v));
+            }
+            else if (v <= 0xff)
+            {
+                _pack_be(buf, 0xcc, v, 1);
+            }
+            else if (v <= 0xffff)
+            {
+                _pack_be(buf, 0xcd, v, 2);
+            }
+            else if (v <= 0xffffffff)
+            {
+                _pack_be(buf, 0xce, v, 4);
+            }
+            else
+            {
+                _pack_be(buf, 0xcf, v, 8);
+            }
+        }
+
+        inline void _pack_signed(buffer& buf, std::int64_t v)
+        {
+            if (v >= 0)
+            {
+                _pack_unsigned(buf, static_cast<std::uint64_t>(v));
+            }
+            else if (v >= -32)
+            {
+                buf.push_back(static_cast<char>(v));
+            }
+            else if (v >= INT8_MIN)
+            {
+                _pack_be(buf, 0xd0, static_cast<std::uint64_t>(v), 1);
+            }
+            else if (v >= INT16_MIN)
+            {
+                _pack_be(buf, 0xd1, static_cast<std::uint64_t>(v), 2);
+            }
+            else if (v >= INT32_MIN)
+            {
+                _pack_be(buf, 0xd2, static_cast<std::uint64_t>(v), 4);
+            }
+            else
+            {
+                _pack_be(buf, 0xd3, static_cast<std::uint64_t>(v), 8);
+            }
+        }
+
+        // Ext header for a payload of n bytes: fixext when n is a power of two up to 16, ext 8/16/32 otherwise
+        inline void _pack_ext_header(buffer& buf, std::int8_t type, std::size_t n)
+        {
+            switch (n)
+            {
+            case 1: buf.push_back(static_cast<char>(0xd4)); break;
+            case 2: buf.push_back(static_cast<char>(0xd5)); break;
+            case 4: buf.push_back(static_cast<char>(0xd6)); break;
+            case 8: buf.push_back(static_cast<char>(0xd7)); break;
+            case 16: buf.push_back(static_cast<char>(0xd8)); break;
+            default:
+                if (n <= 0xff)
+                {
+                    _pack_be(buf, 0xc7, n, 1);
+                }
+                else if (n <= 0xffff)
+                {
+                    _pack_be(buf, 0xc8, n, 2);
+                }
+                else
+                {
+                    _pack_be(buf, 0xc9, n, 4);
+                }
+            }
+            buf.push_back(static_cast<char>(type));
+        }
+
+        // Numbers a typed array can hold, and the element code for each
+        template <typename T>
+        inline constexpr bool is_packed_number_v = is_fast_number_v<T> && !is_character_v<T> && !std::is_same_v<T, bool>
+            && (std::is_integral_v<T> || std::is_same_v<T, float> || std::is_same_v<T, double>);
+
+        template <typename T>
+        constexpr char _pack_code() noexcept
+        {
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                return sizeof(T) == 4 ? 'f' : 'd';
+            }
+            else
+            {
+                constexpr char codes[] = "bhiq";
+                constexpr std::size_t index = sizeof(T) == 1 ? 0 : sizeof(T) == 2 ? 1 : sizeof(T) == 4 ? 2 : 3;
+                return std::is_signed_v<T> ? codes[index] : static_cast<char>(codes[index] - 'a' + 'A');
+            }
+        }
+
+        // Contiguous numbers as one typed_array_ext, copied straight from memory on little-endian targets
+        template <typename T>
+        void _pack_numbers(buffer& buf, T const* values, std::size_t n)
+        {
+            std::size_t const bytes = n * sizeof(T);
+            _pack_ext_header(buf, msgpack::typed_array_ext, 1 + bytes);
+            buf.push_back(_pack_code<T>());
+            char* out = buf.reserve(bytes);
+            if constexpr (_little_endian)
+            {
+                if (bytes != 0)
+                {
+                    std::memcpy(out, values, bytes);
+                }
+            }
+            else
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    char const* in = reinterpret_cast<char const*>(values + i);
+                    std::reverse_copy(in, in + sizeof(T), out + i * sizeof(T));
+                }
+            }
+            buf.commit(bytes);
+        }
+
+        template <std::size_t N>
+        void _pack_bitset(buffer& buf, std::bitset<N> const& bits)
+        {
+            constexpr std::size_t bytes = (N + 7) / 8;
+            _pack_ext_header(buf, msgpack::bitset_ext, 4 + bytes);
+            char* out = buf.reserve(4 + bytes);
+            for (std::size_t i = 0; i < 4; ++i)
+            {
+                out[3 - i] = static_cast<char>(N >> (8 * i));
+            }
+            for (std::size_t k = 0; k < bytes; ++k)
+            {
+                out[4 + k] = static_cast<char>(_bitset_byte(bits, k));
+            }
+            buf.commit(4 + bytes);
+        }
+
+        // A value operator<< accepts: built-in types get their own MessagePack form, anything else is
+        // the str of its default text formatting
+        template <typename T>
+        void _pack_plain(context& ctx, T const& arg)
+        {
+            if constexpr (is_string_like_v<T>)
+            {
+                if (_is_null_string(arg))
+                {
+                    ctx.buf.push_back(static_cast<char>(0xc0));
+                    return;
+                }
+                _pack_string(ctx.buf, std::string_view(arg));
+            }
+            else if constexpr (is_character_v<T>)
+            {
+                char const c = static_cast<char>(arg);
+                _pack_string(ctx.buf, std::string_view(&c, 1));
+            }
+            else if constexpr (std::is_same_v<T, bool>)
+            {
+                ctx.buf.push_back(static_cast<char>(arg ? 0xc3 : 0xc2));
+            }
+            else if constexpr (std::is_integral_v<T> && sizeof(T) <= sizeof(long long) && std::is_signed_v<T>)
+            {
+                _pack_signed(ctx.buf, static_cast<std::int64_t>(arg));
+            }
+            else if constexpr (std::is_integral_v<T> && sizeof(T) <= sizeof(long long))
+            {
+                _pack_unsigned(ctx.buf, static_cast<std::uint64_t>(arg));
+            }
+            else if constexpr (std::is_same_v<T, float>)
+            {
+                std::uint32_t bits;
+                std::memcpy(&bits, &arg, sizeof(bits));
+                _pack_be(ctx.buf, 0xca, bits, 4);
+            }
+            else if constexpr (std::is_floating_point_v<T>)
+            {
+                double const wide = static_cast<double>(arg);
+                std::uint64_t bits;
+                std::memcpy(&bits, &wide, sizeof(bits));
+                _pack_be(ctx.buf, 0xcb, bits, 8);
+            }
+            else if constexpr (is_bitset_v<T>)
+            {
+                _pack_bitset(ctx.buf, arg);
+            }
+            else
+            {
+                std::size_t const at = _pack_placeholder(ctx.buf, 0xdb);
+                ctx.stream() << arg;
+                _pack_patch(ctx.buf, at, ctx.buf.size() - at - 5);
+            }
+        }
+
+        template <typename T>
+        void _print(context& ctx, T const& arg, params const& p);
+
+        template <typename T>
+        void _print_formatted(context& ctx, T const& arg, params const& p);
+
+        template <typename T>
+        void _print_cached(context& ctx, cached_view<T> const& view, params const& p);
+    }
+
+    // Where a formatter writes: the line being formatted
+    class appender
+    {
+    public:
+        appender(appender const&) = delete;
+        appender& operator=(appender const&) = delete;
+
+        void push_back(char c)
+        {
+            _ctx.buf.push_back(c);
+        }
+
+        void append(char const* data, std::size_t size)
+        {
+            _ctx.buf.append(data, size);
+        }
+
+        void append(std::string_view s)
+        {
+            _ctx.buf.append(s);
+        }
+
+        // Room for n more chars to write in place; commit() how many were written
+        char* reserve(std::size_t n)
+        {
+            return _ctx.buf.reserve(n);
+        }
+
+        void commit(std::size_t n)
+        {
+            _ctx.buf.commit(n);
+        }
+
+        // Format any value the way print would, such as a member container
+        template<typename T>
+        void print(T const& value)
+        {
+            details::_print(_ctx, value, _p);
+        }
+
+    private:
+        template <typename T>
+        friend void details::_print_formatted(details::context& ctx, T const& arg, params const& p);
+
+        appender(details::context& ctx, params const& p): _ctx(ctx), _p(p) {}
+
+        details::context& _ctx;
+        params const& _p;
+    };
+
+    namespace details
+    {
+        template <typename T>
+        void _print_formatted(context& ctx, T const& arg, params const& p)
+        {
+            formatter<T> const f{};
+            if (!ctx.fast)
+            { // A pending width is not left for whatever the stream writes next
+                ctx.stream().width(0);
+            }
+            if constexpr (has_size_hint_v<T>)
+            {
+                ctx.buf.reserve(f.size_hint(arg));
+            }
+            appender out(ctx, p);
+            f.format(arg, out);
+        }
+
+        struct identity
+        {
+            template <typename T>
+            T const& operator()(T const& value) const noexcept { return value; }
+        };
+
+        struct dereference
+        {
+            template <typename T>
+            T const& operator()(T const* ptr) const noexcept { return *ptr; }
+        };
+
+        struct _item_streamer;
+
+        // Walk the comma-separated items of [first, last), count of them if known (-1 if not), calling
+        // v.item(x) for each shown item, v.comma() between them and v.ellipsis() for the gap. When the
+        // range is longer than ctx.max_items only edge_items from each end are shown around "...", touching
+        // just those; ranges that are forward-only, or whose length is unknown, keep only the head. last may
+        // be a sentinel. Single-pass ranges of unknown length cannot be looked ahead in, so their items past
+        // the head are shown and, once there turn out to be too many, taken back with v.mark()/v.rewind();
+        // _item_streamer has already written them out, so for it the head is followed by "..." as soon as
+        // one more item exists.
+        template <typename It, typename Sentinel, typename Proj, typename Visitor>
+        void _visit_items(context const& ctx, It first, Sentinel last, std::ptrdiff_t count, Proj proj, Visitor&& v)
+        {
+            bool first_item = true;
+            auto next_item = [&]
+            {
+                if (!first_item)
+                {
+                    v.comma();
+                }
+                first_item = false;
+            };
+            auto print_until = [&](It& it, std::size_t limit)
+            {
+                for (std::size_t i = 0; it != last && i < limit; ++it, ++i)
+                {
+                    next_item();
+                    v.item(proj(*it));
+                }
+            };
+            std::size_t const all = static_cast<std::size_t>(-1);
+            if (ctx.max_items == 0 || (count >= 0 && static_cast<std::size_t>(count) <= ctx.max_items))
+            {
+                print_until(first, all);
+                return;
+            }
+            std::size_t const edge = ctx.edge_items;
+            if (count < 0)
+            {
+                print_until(first, edge);
+                if constexpr (is_iterator_of_v<It, std::forward_iterator_tag>)
+                { // Unknown length: look at most max_items past the head to find out whether to truncate
+                    It probe = first;
+                    std::size_t seen = edge;
+                    for (; probe != last && seen <= ctx.max_items; ++probe, ++seen)
+                    {
+                    }
+                    if (!(probe != last) && seen <= ctx.max_items)
+                    {
+                        print_until(first, all);
+                        return;
+                    }
+                }
+                else if constexpr (std::is_same_v<std::decay_t<Visitor>, _item_streamer>)
+                { // Streamed output cannot be taken back: one more element after the head cuts the rest short
+                    if (!(first != last))
+                    {
+                        return;
+                    }
+                }
+                else
+                { // Single pass: show up to max_items and take back all but the head if more follow
+                    auto const mark = v.mark();
+                    bool const head_empty = first_item;
+                    print_until(first, ctx.max_items > edge ? ctx.max_items - edge : 0);
+                    if (!(first != last))
+                    {
+                        return;
+                    }
+                    v.rewind(mark);
+                    first_item = head_empty;
+                }
+                next_item();
+                v.ellipsis();
+                return;
+            }
+            constexpr bool bidirectional = std::is_same_v<It, Sentinel> && is_iterator_of_v<It, std::bidirectional_iterator_tag>;
+            if (edge >= static_cast<std::size_t>(count) || (bidirectional && 2 * edge >= static_cast<std::size_t>(count)))
+            {
+                print_until(first, all);
+                return;
+            }
+            print_until(first, edge);
+            next_item();
+            v.ellipsis();
+            if constexpr (bidirectional)
+            {
+                It tail = std::prev(last, static_cast<std::ptrdiff_t>(edge));
+                print_until(tail, all);
+            }
+        }
+
+        struct _item_printer
+        {
+            context& ctx;
+            params const& p;
+
+            template <typename T>
+            void item(T const& value)
+            {
+                _print(ctx, value, p);
+            }
+
+            void comma()
+            {
+                ctx.put(',');
+            }
+
+            void ellipsis()
+            {
+                ctx.write("...");
+            }
+
+            std::size_t mark() const noexcept
+            {
+                return ctx.buf.size();
+            }
+
+            void rewind(std::size_t mark) noexcept
+            {
+                ctx.buf.truncate(mark);
+            }
+        };
+
+        template <typename It, typename Sentinel, typename Proj = identity>
+        void _print_items(context& ctx, It first, Sentinel last, params const& p, std::ptrdiff_t count = -1, Proj proj = {})
+        {
+            _visit_items(ctx, first, last, count, proj, _item_printer{ctx, p});
+        }
+
+        // Encodes items as MessagePack array elements, counting them and writing nil for "..."
+        struct _item_packer
+        {
+            context& ctx;
+            params const& p;
+            std::size_t count = 0;
+
+            template <typename T>
+            void item(T const& value)
+            {
+                ++count;
+                _print(ctx, value, p);
+            }
+
+            void comma() noexcept
+            {
+            }
+
+            void ellipsis()
+            {
+                ++count;
+                ctx.buf.push_back(static_cast<char>(0xc0));
+            }
+
+            std::pair<std::size_t, std::size_t> mark() const noexcept
+            {
+                return {ctx.buf.size(), count};
+            }
+
+            void rewind(std::pair<std::size_t, std::size_t> mark) noexcept
+            {
+                ctx.buf.truncate(mark.first);
+                count = mark.second;
+            }
+        };
+
+        // A container as a MessagePack array, with the same truncation as text: nil stands for "..."
+        template <typename It, typename Sentinel, typename Proj>
+        void _pack_container(context& ctx, It first, Sentinel last, params const& p, std::ptrdiff_t count, Proj proj)
+        {
+            if (ctx.max_depth != 0 && ctx.depth >= ctx.max_depth)
+            {
+                bool const empty = !(first != last);
+                _pack_array_header(ctx.buf, empty ? 0 : 1);
+                if (!empty)
+                {
+                    ctx.buf.push_back(static_cast<char>(0xc0));
+                }
+                return;
+            }
+            ++ctx.depth;
+            if (count >= 0 && (ctx.max_items == 0 || static_cast<std::size_t>(count) <= ctx.max_items))
+            {
+                _pack_array_header(ctx.buf, static_cast<std::size_t>(count));
+                _visit_items(ctx, first, last, count, proj, _item_packer{ctx, p});
+            }
+            else
+            {
+                std::size_t const at = _pack_placeholder(ctx.buf, 0xdd);
+                _item_packer items{ctx, p};
+                _visit_items(ctx, first, last, count, proj, items);
+                _pack_patch(ctx.buf, at, items.count);
+            }
+            --ctx.depth;
+        }
+
+        // Print a container's items between brackets, honoring max_depth
+        template <typename It, typename Sentinel, typename Proj = identity>
+        void _print_container(context& ctx, It first, Sentinel last, params const& p, std::ptrdiff_t count = -1, Proj proj = {})
+        {
+            if (ctx.binary)
+            {
+                _pack_container(ctx, first, last, p, count, proj);
+                return;
+            }
+            ctx.put('[');
+            if (ctx.max_depth != 0 && ctx.depth >= ctx.max_depth)
+            {
+                if (first != last)
+                {
+                    ctx.write("...");
+                }
+            }
+            else
+            {
+                ++ctx.depth;
+                _print_items(ctx, first, last, p, count, proj);
+                --ctx.depth;
+            }
+            ctx.put(']');
+        }
+
+        // Smallest chunk worth a thread of its own
+        inline constexpr std::size_t _parallel_chunk_items = std::size_t(1) << 14;
+
+        // Print a large random-access container in chunks formatted on ctx.parallel threads, each into its own
+        // buffer, and join them in order, so the output is the same as serial formatting. The calling thread
+        // formats the first chunk itself. Returns false, printing nothing, when there are too few items.
+        template <typename T>
+        bool _print_parallel(context& ctx, T const& arg, params const& p, std::size_t count)
+        {
+            std::size_t const chunks = std::min<std::size_t>(ctx.parallel, count / _parallel_chunk_items);
+            if (chunks < 2)
+            {
+                return false;
+            }
+            auto const bound = [&](std::size_t chunk)
+            {
+                return static_cast<std::ptrdiff_t>(count * chunk / chunks);
+            };
+            auto const format_chunk = [&arg, &p, &bound](context& c, std::size_t chunk)
+            {
+                auto const first = bound(chunk);
+                auto const last = bound(chunk + 1);
+                if constexpr (is_contiguous_arithmetic_v<T>)
+                {
+                    if (c.fast)
+                    {
+                        _append_numbers(c.buf, std::data(arg) + first, static_cast<std::size_t>(last - first));
+                        return;
+                    }
+                }
+                _print_items(c, std::begin(arg) + first, std::begin(arg) + last, p, last - first);
+            };
+
+            struct part
+            {
+                buffer buf;
+                arena scratch;
+                std::exception_ptr error;
+            };
+            // Joins the workers started so far and restores ctx however the chunks end, including when
+            // starting a thread throws
+            struct join_guard
+            {
+                context& ctx;
+                std::vector<std::thread>& workers;
+                unsigned const parallel;
+
+                ~join_guard()
+                {
+                    for (auto& worker : workers)
+                    {
+                        worker.join();
+                    }
+                    ctx.parallel = parallel;
+                    --ctx.depth;
+                }
+            };
+            std::unique_ptr<part[]> parts(new part[chunks - 1]);
+            std::vector<std::thread> workers;
+            workers.reserve(chunks - 1);
+            ctx.put('[');
+            std::exception_ptr error;
+            {
+                ++ctx.depth;
+                join_guard const guard{ctx, workers, ctx.parallel};
+                ctx.parallel = 0; // Nested containers stay on the thread that reached them
+                for (std::size_t chunk = 1; chunk < chunks; ++chunk)
+                {
+                    workers.emplace_back([&, chunk, source = ctx.format_source(), depth = ctx.depth]
+                    {
+                        part& out = parts[chunk - 1];
+                        try
+                        { // Workers only read the source, and the caller does not write to it while they run
+                            context worker(out.buf, out.scratch, source, p, false);
+                            worker.depth = depth;
+                            worker.parallel = 0;
+                            if (!worker.fast)
+                            { // A pending width was spent on the opening bracket
+                                worker.stream().width(0);
+                            }
+                            format_chunk(worker, chunk);
+                        }
+                        catch (...)
+                        {
+                            out.error = std::current_exception();
+                        }
+                    });
+                }
+                try
+                {
+                    format_chunk(ctx, 0);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+            }
+            for (std::size_t chunk = 1; chunk < chunks && !error; ++chunk)
+            {
+                error = parts[chunk - 1].error;
+            }
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+            for (std::size_t chunk = 1; chunk < chunks; ++chunk)
+            {
+                ctx.put(',');
+                ctx.buf.append(parts[chunk - 1].buf.data(), parts[chunk - 1].buf.size());
+            }
+            ctx.put(']');
+            return true;
+        }
+
+        // Print one value; containers recurse into their elements
+        template <typename T>
+        void _print(context& ctx, T const& arg, params const& p)
+        {
+            constexpr category kind = category_v<T>;
+
+            // Text kept from an earlier print of the same value
+            if constexpr (kind == category::cached)
+            {
+                _print_cached(ctx, arg, p);
+            }
+            else // User formatter, checked before operator<<
+            if constexpr (kind == category::formatted)
+            {
+                if (ctx.binary)
+                { // Encoded as the str of its text, including anything it passes to appender::print
+                    std::size_t const at = _pack_placeholder(ctx.buf, 0xdb);
+                    ctx.binary = false;
+                    _print_formatted(ctx, arg, p);
+                    ctx.binary = true;
+                    _pack_patch(ctx.buf, at, ctx.buf.size() - at - 5);
+                }
+                else
+                {
+                    _print_formatted(ctx, arg, p);
+                }
+            }
+            else // Plain printable, the recursion ends here
+            if constexpr (kind == category::plain)
+            {
+                if (ctx.binary)
+                {
+                    _pack_plain(ctx, arg);
+                }
+                else
+                {
+                    _print_plain(ctx, arg);
+                }
+            }
+            else // Iterables except string
+            if constexpr (kind == category::iterable)
+            {
+                std::ptrdiff_t count = -1;
+                if constexpr (has_size_v<T>)
+                {
+                    count = static_cast<std::ptrdiff_t>(std::size(arg));
+                }
+                _stats_container(count);
+                bool const whole = (ctx.max_items == 0 || (count >= 0 && static_cast<std::size_t>(count) <= ctx.max_items))
+                                   && (ctx.max_depth == 0 || ctx.depth < ctx.max_depth);
+                bool done = false;
+                if constexpr (is_random_access_v<T>)
+                {
+                    if (whole && ctx.parallel > 1 && !ctx.binary)
+                    {
+                        done = _print_parallel(ctx, arg, p, static_cast<std::size_t>(count));
+                    }
+                }
+                if constexpr (is_contiguous_arithmetic_v<T>)
+                { // Contiguous numbers go out as one run when no limit or stream state gets in the way
+                    if constexpr (is_packed_number_v<std::remove_cv_t<std::remove_pointer_t<decltype(std::data(arg))>>>)
+                    {
+                        if (ctx.binary && whole)
+                        {
+                            _pack_numbers(ctx.buf, std::data(arg), static_cast<std::size_t>(count));
+                            done = true;
+                        }
+                    }
+                    if (!done && ctx.fast && whole && !ctx.binary)
+                    {
+                        ctx.buf.push_back('[');
+                        _append_numbers(ctx.buf, std::data(arg), static_cast<std::size_t>(count));
+                        ctx.buf.push_back(']');
+                        done = true;
+                    }
+                }
+                if (!done)
+                {
+                    _print_container(ctx, std::begin(arg), std::end(arg), p, count);
+                }
+            }
+            else // Pair
+            if constexpr (kind == category::pair)
+            {
+                if (ctx.binary)
+                {
+                    _pack_array_header(ctx.buf, 2);
+                    _print(ctx, arg.first, p);
+                    _print(ctx, arg.second, p);
+                    return;
+                }
+                ctx.put('(');
+                _print(ctx, arg.first, p);
+                ctx.put(',');
+                _print(ctx, arg.second, p);
+                ctx.put(')');
+            }
+            else // Tuple
+            if constexpr (kind == category::tuple)
+            {
+                if (ctx.binary)
+                {
+                    _pack_array_header(ctx.buf, std::tuple_size_v<T>);
+                    std::apply([&](auto const&... elems) { (_print(ctx, elems, p), ...); }, arg);
+                    return;
+                }
+                ctx.put('(');
+                std::apply(
+                    [&](auto const&... elems)
+                    {
+                        bool first = true;
+                        ([&](auto const& elem)
+                         {
+                            if (!first)
+                            {
+                                ctx.put(',');
+                            }
+                            _print(ctx, elem, p);
+                            first = false;
+                         }(elems), ...);
+                    }, arg);
+                ctx.put(')');
+            }
+            else // Container adapters, read in place from the underlying container
+            if constexpr (kind == category::adapter)
+            {
+                auto const& c = adapter_access<T>::container(arg);
+                auto const count = static_cast<std::ptrdiff_t>(c.size());
+                _stats_container(count);
+                if constexpr (is_std_queue_v<T>)
+                { // Queue pops from the front
+                    _print_container(ctx, c.begin(), c.end(), p, count);
+                }
+                else if constexpr (is_priority_queue_v<T>)
+                { // Priority queue pops largest first: sort pointers to the elements instead of popping a copy
+                    using value_type = typename T::value_type;
+                    auto** const order = ctx.scratch.allocate<value_type const*>(c.size());
+                    auto** const order_end = std::transform(c.begin(), c.end(), order,
+                        [](value_type const& item) { return &item; });
+                    auto const& comp = adapter_access<T>::compare(arg);
+                    auto const before = [&comp](value_type const* a, value_type const* b) { return comp(*b, *a); };
+                    std::size_t const edge = ctx.edge_items;
+                    bool const hidden = ctx.max_depth != 0 && ctx.depth >= ctx.max_depth;
+                    bool const truncated = ctx.max_items != 0 && c.size() > ctx.max_items && 2 * edge < c.size();
+                    if (!hidden && truncated)
+                    { // Only the ends are printed, so only they need to be in order
+                        std::partial_sort(order, order + edge, order_end, before);
+                        std::nth_element(order + edge, order_end - edge, order_end, before);
+                        std::sort(order_end - edge, order_end, before);
+                    }
+                    else if (!hidden)
+                    {
+                        std::sort(order, order_end, before);
+                    }
+                    _print_container(ctx, order, order_end, p, count, dereference{});
+                }
+                else
+                { // Stack pops from the back
+                    _print_container(ctx, c.rbegin(), c.rend(), p, count);
+                }
+            }
+            else static_assert(always_false_v<T>, "Object is not printable.");
+        }
+
+        // Digits in v: estimated from its bit length (1233 / 4096 is about log10(2)), then corrected
+        // (the first power is 0 so that 0 still has one digit)
+        inline std::size_t _count_digits(std::uint64_t v) noexcept
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            static constexpr std::uint64_t powers[] = {
+                0ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+                1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+                100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+                1000000000000000000ull, 10000000000000000000ull};
+            auto const estimate = static_cast<std::size_t>((64 - __builtin_clzll(v | 1)) * 1233 >> 12);
+            return estimate + 1 - (v < powers[estimate]);
+#else
+            std::size_t digits = 1;
+            for (; v >= 10000; v /= 10000)
+            {
+                digits += 4;
+            }
+            return digits + (v >= 10) + (v >= 100) + (v >= 1000);
+#endif
+        }
+
+        // Length of the run _append_numbers writes for n values
+        template <typename T>
+        std::size_t _measure_numbers(T const* values, std::size_t n) noexcept
+        {
+            std::size_t size = n == 0 ? 0 : n - 1;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                if constexpr (std::is_signed_v<T>)
+                {
+                    size += values[i] < 0 ? 1 + _count_digits(0 - static_cast<std::uint64_t>(values[i]))
+                                          : _count_digits(static_cast<std::uint64_t>(values[i]));
+                }
+                else
+                {
+                    size += _count_digits(values[i]);
+                }
+            }
+            return size;
+        }
+
+        template <std::size_t N>
+        constexpr std::size_t _bitset_size(std::bitset<N> const&, bitset_format format) noexcept
+        {
+            switch (format)
+            {
+            case bitset_format::hex:
+                return (N + 3) / 4 + 2;
+            case bitset_format::grouped:
+                return N == 0 ? 0 : N + (N - 1) / 4;
+            default:
+                return N;
+            }
+        }
+
+        // Length of a value found by formatting it and dropping the output again
+        template <typename T>
+        std::size_t _measure_by_printing(context& ctx, T const& arg, params const& p)
+        {
+            std::size_t const start = ctx.buf.size();
+            _print(ctx, arg, p);
+            std::size_t const size = ctx.buf.size() - start;
+            ctx.buf.truncate(start);
+            return size;
+        }
+
+        template <typename T>
+        std::size_t _measure(context& ctx, T const& arg, params const& p);
+
+        struct _item_measurer
+        {
+            context& ctx;
+            params const& p;
+            std::size_t size = 0;
+
+            template <typename T>
+            void item(T const& value)
+            {
+                size += _measure(ctx, value, p);
+            }
+
+            void comma()
+            {
+                size += 1;
+            }
+
+            void ellipsis()
+            {
+                size += 3;
+            }
+
+            std::size_t mark() const noexcept
+            {
+                return size;
+            }
+
+            void rewind(std::size_t mark) noexcept
+            {
+                size = mark;
+            }
+        };
+
+        template <typename It, typename Sentinel, typename Proj = identity>
+        std::size_t _measure_container(context& ctx, It first, Sentinel last, params const& p, std::ptrdiff_t count = -1, Proj proj = {})
+        {
+            if (ctx.max_depth != 0 && ctx.depth >= ctx.max_depth)
+            {
+                return first != last ? 5 : 2;
+            }
+            ++ctx.depth;
+            _item_measurer items{ctx, p};
+            _visit_items(ctx, first, last, count, proj, items);
+            --ctx.depth;
+            return items.size + 2;
+        }
+
+        // Exact length _print writes for arg: counted for numbers, strings, bitsets and containers of them,
+        // and formatted then dropped for anything else (floats, operator<<, formatter and stream state)
+        template <typename T>
+        std::size_t _measure(context& ctx, T const& arg, params const& p)
+        {
+            constexpr category kind = category_v<T>;
+
+            if constexpr (kind == category::cached)
+            {
+                return _measure(ctx, *arg.value, p);
+            }
+            else if constexpr (kind == category::plain)
+            {
+                if (ctx.fast)
+                {
+                    if constexpr (is_string_like_v<T>)
+                    {
+                        if (!_is_null_string(arg))
+                        {
+                            return std::string_view(arg).size();
+                        }
+                    }
+                    else if constexpr (is_character_v<T> || std::is_same_v<T, bool>)
+                    {
+                        return 1;
+                    }
+                    else if constexpr (std::is_integral_v<T> && sizeof(T) <= sizeof(long long))
+                    {
+                        if constexpr (std::is_signed_v<T>)
+                        {
+                            if (arg < 0)
+                            {
+                                return 1 + _count_digits(0 - static_cast<std::uint64_t>(arg));
+                            }
+                        }
+                        return _count_digits(static_cast<std::uint64_t>(arg));
+                    }
+                    else if constexpr (is_bitset_v<T>)
+                    {
+                        return _bitset_size(arg, ctx.bits);
+                    }
+                }
+                return _measure_by_printing(ctx, arg, p);
+            }
+            else if constexpr (kind == category::iterable)
+            {
+                std::ptrdiff_t count = -1;
+                if constexpr (has_size_v<T>)
+                {
+                    count = static_cast<std::ptrdiff_t>(std::size(arg));
+                }
+                if constexpr (is_contiguous_arithmetic_v<T>)
+                {
+                    using value_type = std::remove_cv_t<std::remove_pointer_t<decltype(std::data(arg))>>;
+                    if constexpr (std::is_integral_v<value_type> && !is_character_v<value_type>
+                                  && !std::is_same_v<value_type, bool>)
+                    { // Same conditions as the bulk path in _print
+                        if (ctx.fast && (ctx.max_items == 0 || static_cast<std::size_t>(count) <= ctx.max_items)
+                            && (ctx.max_depth == 0 || ctx.depth < ctx.max_depth))
+                        {
+                            return 2 + _measure_numbers(std::data(arg), static_cast<std::size_t>(count));
+                        }
+                    }
+                }
+                return _measure_container(ctx, std::begin(arg), std::end(arg), p, count);
+            }
+            else if constexpr (kind == category::pair)
+            {
+                return 3 + _measure(ctx, arg.first, p) + _measure(ctx, arg.second, p);
+            }
+            else if constexpr (kind == category::tuple)
+            {
+                return std::apply([&](auto const&... elems)
+                {
+                    std::size_t const brackets_and_commas = sizeof...(elems) == 0 ? 2 : sizeof...(elems) + 1;
+                    return (brackets_and_commas + ... + _measure(ctx, elems, p));
+                }, arg);
+            }
+            else if constexpr (kind == category::adapter)
+            {
+                auto const& c = adapter_access<T>::container(arg);
+                auto const count = static_cast<std::ptrdiff_t>(c.size());
+                if constexpr (is_std_queue_v<T>)
+                {
+                    return _measure_container(ctx, c.begin(), c.end(), p, count);
+                }
+                else if constexpr (is_priority_queue_v<T>)
+                { // Which elements a truncated queue shows depends on their order; otherwise order does not matter
+                    if (ctx.max_items != 0 && c.size() > ctx.max_items)
+                    {
+                        return _measure_by_printing(ctx, arg, p);
+                    }
+                    return _measure_container(ctx, c.begin(), c.end(), p, count);
+                }
+                else
+                {
+                    return _measure_container(ctx, c.rbegin(), c.rend(), p, count);
+                }
+            }
+            else
+            {
+                return _measure_by_printing(ctx, arg, p);
+            }
+        }
+
+        // The last of a pack
+        template <typename... Ts>
+        decltype(auto) _last(Ts const&... args)
+        {
+            return std::get<sizeof...(Ts) - 1>(std::forward_as_tuple(args...));
+        }
+
+        // One argument of a line: a separator before all but the first, and the trailing params skipped
+        template <typename T>
+        void _print_argument(context& ctx, T const& arg, params const& p, bool& first)
+        {
+            if constexpr (!std::is_same_v<T, params>)
+            {
+                if (!first)
+                {
+                    ctx.write(p.sep);
+                }
+                first = false;
+                _print(ctx, arg, p);
+            }
+        }
+
+        template <typename T>
+        void _pack_argument(context& ctx, T const& arg, params const& p)
+        {
+            if constexpr (!std::is_same_v<T, params>)
+            {
+                _print(ctx, arg, p);
+            }
+        }
+
+        template <typename T>
+        std::size_t _measure_argument(context& ctx, T const& arg, params const& p, bool& first)
+        {
+            if constexpr (std::is_same_v<T, params>)
+            {
+                return 0;
+            }
+            else
+            {
+                std::size_t const sep = first ? 0 : std::strlen(p.sep);
+                first = false;
+                return sep + _measure(ctx, arg, p);
+            }
+        }
+
+        // Length of the line print would write for args, params last, formatted as format_source would
+        template <typename... Ts>
+        std::size_t _measure_line(std::ostream const* format_source, Ts const&... args)
+        {
+            auto const& p = _last(args...);
+            buffer_lease lease;
+            context ctx(lease.get(), lease.scratch(), format_source, p);
+            if (ctx.binary)
+            { // Encoded lengths are not worth counting ahead
+                _format_line(ctx, args...);
+                return ctx.buf.size();
+            }
+            std::size_t size = std::strlen(p.end);
+            bool first = true;
+            ((size += _measure_argument(ctx, args, p, first)), ...);
+            return size;
+        }
+
+        // Format a whole line, params last, exactly as print writes it
+        template <typename... Ts>
+        void _format_line(context& ctx, Ts const&... args)
+        {
+            auto const& p = _last(args...);
+            static_assert(std::is_same_v<std::decay_t<decltype(p)>, params>,
+                "Last argument must be params, but it is not. Why?");
+            bool first = true;
+            if (ctx.binary)
+            { // One array of the arguments, without separators or end
+                _pack_array_header(ctx.buf, sizeof...(Ts) - 1);
+                (_pack_argument(ctx, args, p), ...);
+                return;
+            }
+            (_print_argument(ctx, args, p, first), ...);
+            ctx.write(p.end);
+        }
+
+        inline void _submit(async_printer& printer, std::ostream& out, std::string_view bytes, bool flush);
+
+        inline void _write_line(sink& to, std::string_view bytes, params const& p)
+        {
+            to.write(bytes.data(), bytes.size());
+            if (p.flush)
+            {
+                to.flush();
+            }
+        }
+
+        // With state, also carry over what formatting did to the stream state, under the same lock as the write
+        inline void _write_line(std::ostream& out, std::string_view bytes, params const& p, context* state = nullptr)
+        {
+            std::unique_lock<std::mutex> lock;
+            if (p.atomic)
+            { // Formatting is done; only the write itself is serialized
+                lock = std::unique_lock<std::mutex>(stream_lock(out));
+            }
+            out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            if (p.flush)
+            {
+                out.flush();
+            }
+            if (state)
+            {
+                std::unique_lock<std::mutex> format;
+                if (p.atomic)
+                {
+                    format = std::unique_lock<std::mutex>(format_lock(out));
+                }
+                state->sync_state(out);
+            }
+        }
+
+        // Write the same formatted line to each of params::tee
+        inline void _commit_tee(std::string_view bytes, params const& p)
+        {
+            for (destination const& d : p.tee)
+            {
+                if (d.to)
+                {
+                    _write_line(*d.to, bytes, p);
+                }
+                else if (d.stream && p.tee_async)
+                {
+                    _submit(*p.tee_async, *d.stream, bytes, p.flush);
+                }
+                else if (d.stream)
+                {
+                    _write_line(*d.stream, bytes, p);
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+
+        // Write a formatted line to params::out as print does, honoring policy, atomic and flush, then to params::tee
+        inline void _commit_line(context& ctx, params const& p)
+        {
+            if (p.to)
+            {
+                _write_line(*p.to, ctx.view(), p);
+            }
+            else if (p.policy)
+            { // The policy serializes its own writes
+                p.policy->write(p.out, ctx.view(), p.flush);
+                std::unique_lock<std::mutex> lock;
+                std::unique_lock<std::mutex> format;
+                if (p.atomic)
+                {
+                    lock = std::unique_lock<std::mutex>(stream_lock(p.out));
+                    format = std::unique_lock<std::mutex>(format_lock(p.out));
+                }
+                ctx.sync_state(p.out);
+            }
+            else
+            {
+                _write_line(p.out, ctx.view(), p, &ctx);
+            }
+            if (p.tee[0])
+            {
+                _commit_tee(ctx.view(), p);
+            }
+        }
+
+        // Lines for a sink, and MessagePack, are formatted with default formatting rather than by params::out's state
+        inline std::ostream const* _format_source(params const& p)
+        {
+            return p.to || p.encode != encoding::text ? nullptr : &p.out;
+        }
+
+        // Format a whole line into the thread's buffer and write it to params::out (or params::to) at once
+        template <typename... Ts>
+        void _print_line(Ts const&... args)
+        {
+            auto const& p = std::get<sizeof...(args) - 1>(std::forward_as_tuple(args...));
+            _call_stats call;
+            buffer_lease lease;
+            context ctx(lease.get(), lease.scratch(), _format_source(p), p);
+            _format_line(ctx, args...);
+            call.formatted(ctx.buf.size());
+            _commit_line(ctx, p);
+        }
+
+        // Format args with a separator and end fixed at compile time
+        template <typename Sep, typename End, typename... Ts, std::size_t... I>
+        void _format_literal_line(context& ctx, params const& p, std::index_sequence<I...>, Ts const&... args)
+        {
+            if (ctx.binary)
+            {
+                _pack_array_header(ctx.buf, sizeof...(Ts));
+                (_print(ctx, args, p), ...);
+                return;
+            }
+            (((I == 0 ? void() : ctx.write_literal(Sep::value)), _print(ctx, args, p)), ...);
+            ctx.write_literal(End::value);
+        }
+
+        template <typename Sep, typename End, typename... Ts>
+        void _print_literal_line(params const& p, Ts const&... args)
+        {
+            _call_stats call;
+            buffer_lease lease;
+            context ctx(lease.get(), lease.scratch(), _format_source(p), p);
+            _format_literal_line<Sep, End>(ctx, p, std::index_sequence_for<Ts...>{}, args...);
+            call.formatted(ctx.buf.size());
+            _commit_line(ctx, p);
+        }
+
+        // Tuple of references without its last element
+        template <typename... Ts, std::size_t... I>
+        auto _drop_last(std::tuple<Ts const&...> const& t, std::index_sequence<I...>)
+        {
+            return std::forward_as_tuple(std::get<I>(t)...);
+        }
+
+        template <typename... Ts>
+        auto _drop_last(std::tuple<Ts const&...> const& t)
+        {
+            return _drop_last(t, std::make_index_sequence<sizeof...(Ts) - 1>{});
+        }
+
+        // Format a whole line with default formatting state and hand the bytes to done
+        template <typename Done, typename... Ts>
+        decltype(auto) _format_with(Done&& done, Ts const&... args)
+        {
+            auto const& p = std::get<sizeof...(args) - 1>(std::forward_as_tuple(args...));
+            buffer_lease lease;
+            context ctx(lease.get(), lease.scratch(), nullptr, p);
+            _format_line(ctx, args...);
+            return done(std::string_view(ctx.buf.data(), ctx.buf.size()));
+        }
+
+        // Prints items like _item_printer (or _item_packer), but writes the line out, flushed, whenever piece
+        // bytes have built up, unless items may still be taken back
+        struct _item_streamer
+        {
+            context& ctx;
+            params const& p;
+            std::size_t piece;
+            // Keep the whole line until it ends, for MessagePack arrays whose length is not known up front
+            bool hold = false;
+            std::size_t count = 0;
+
+            template <typename T>
+            void item(T const& value)
+            {
+                ++count;
+                _print(ctx, value, p);
+                if (!hold && ctx.buf.size() >= piece)
+                {
+                    params flushed = p;
+                    flushed.flush = true;
+                    _commit_line(ctx, flushed);
+                    ctx.buf.clear();
+                }
+            }
+
+            void comma()
+            {
+                if (!ctx.binary)
+                {
+                    ctx.put(',');
+                }
+            }
+
+            void ellipsis()
+            {
+                ++count;
+                if (ctx.binary)
+                {
+                    ctx.buf.push_back(static_cast<char>(0xc0));
+                }
+                else
+                {
+                    ctx.write("...");
+                }
+            }
+        };
+    }
+
+    // With PYPRINT_EXTERN_TEMPLATES defined, printing the most common types is compiled only once, in
+    // the translation unit that defines PYPRINT_INSTANTIATE before including this header
+#if defined(PYPRINT_INSTANTIATE)
+#define PYPRINT_TEMPLATE_DECLARATION template
+#elif defined(PYPRINT_EXTERN_TEMPLATES)
+#define PYPRINT_TEMPLATE_DECLARATION extern template
+#endif
+
+#if defined(PYPRINT_TEMPLATE_DECLARATION)
+    namespace details
+    {
+        PYPRINT_TEMPLATE_DECLARATION void _print(context&, int const&, params const&);
+        PYPRINT_TEMPLATE_DECLARATION void _print(context&, long long const&, params const&);
+        PYPRINT_TEMPLATE_DECLARATION void _print(context&, double const&, params const&);
+        PYPRINT_TEMPLATE_DECLARATION void _print(context&, std::string const&, params const&);
+        PYPRINT_TEMPLATE_DECLARATION void _print(context&, std::vector<int> const&, params const&);
+    }
+#undef PYPRINT_TEMPLATE_DECLARATION
+#endif
+
+    inline void print(params const& p = {})
+    {
+        details::_print_line(p);
+    }
+
+    template <typename T, typename... Ts>
+    void print(T const& arg, Ts const&... args)
+    {
+        if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            details::_print_line(arg, args...);
+        }
+        else
+        {
+            details::_print_line(arg, args..., params{});
+        }
+    }
+
+    // print with separator and end fixed at compile time, e.g. print<static_sep<',', ' '>, static_end<'\n'>>(a, b).
+    // A trailing params still selects out, flush, policy and atomic; its sep and end are not used.
+    template <typename Option, typename... Options, typename... Ts>
+    std::enable_if_t<traits::are_static_options_v<Option, Options...>> print(Ts const&... args)
+    {
+        using sep = typename traits::find_option<traits::is_static_sep, static_sep<' '>, Option, Options...>::type;
+        using end = typename traits::find_option<traits::is_static_end, static_end<'\n'>, Option, Options...>::type;
+        if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            std::apply([&](auto const&... values)
+            {
+                details::_print_literal_line<sep, end>(std::get<sizeof...(Ts) - 1>(std::forward_as_tuple(args...)), values...);
+            }, details::_drop_last(std::forward_as_tuple(args...)));
+        }
+        else
+        {
+            details::_print_literal_line<sep, end>(params{}, args...);
+        }
+    }
+
+    namespace details
+    {
+        // Monotonic nanoseconds, from the coarse clock where there is one: limiting to whole seconds does
+        // not need better than its few milliseconds, and it is several times cheaper to read
+        inline std::int64_t _coarse_now_ns() noexcept
+        {
+#if defined(PYPRINT_HAS_POSIX) && defined(CLOCK_MONOTONIC_COARSE)
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            return static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        }
+
+        // Appended to a rate-limited line after calls were held back
+        struct _suppressed
+        {
+            std::uint64_t count;
+        };
+    }
+
+    template<>
+    struct formatter<details::_suppressed>
+    {
+        void format(details::_suppressed const& note, appender& out) const
+        {
+            out.push_back('(');
+            out.print(note.count);
+            out.append(" suppressed)");
+        }
+    };
+
+    // Limits for print_limited. Each decides with one atomic operation and no formatting; admit() returns
+    // whether to print and, if so, stores how many calls it held back since the last one it let through.
+    namespace limit
+    {
+        // Lets through the first call and every n-th after it
+        class every_n
+        {
+        public:
+            explicit every_n(std::uint64_t n) noexcept: _n(n == 0 ? 1 : n) {}
+
+            bool admit(std::uint64_t& suppressed) noexcept
+            {
+                std::uint64_t const call = _calls.fetch_add(1, std::memory_order_relaxed);
+                suppressed = call == 0 ? 0 : _n - 1;
+                return call % _n == 0;
+            }
+
+        private:
+            std::uint64_t const _n;
+            std::atomic<std::uint64_t> _calls{0};
+        };
+
+        // Lets through the first n calls only
+        class first_n
+        {
+        public:
+            explicit first_n(std::uint64_t n) noexcept: _n(n) {}
+
+            bool admit(std::uint64_t& suppressed) noexcept
+            {
+                suppressed = 0;
+                return _calls.load(std::memory_order_relaxed) < _n
+                    && _calls.fetch_add(1, std::memory_order_relaxed) < _n;
+            }
+
+        private:
+            std::uint64_t const _n;
+            std::atomic<std::uint64_t> _calls{0};
+        };
+
+        // Token bucket of rate calls per second that holds up to one second's worth, and at least one call: a
+        // burst of rate calls is let through at once, then one every 1/rate seconds. Kept as the time the bucket
+        // will be full again (GCRA), so a call is one clock read and one compare-and-swap. now reads monotonic
+        // nanoseconds.
+        class per_second
+        {
+        public:
+            using clock = std::int64_t (*)() noexcept;
+
+            explicit per_second(double rate, clock now = details::_coarse_now_ns) noexcept:
+                _interval(static_cast<std::int64_t>(1e9 / (rate > 0 ? rate : 1e-9))),
+                _window(std::max<std::int64_t>(1000000000, _interval)), _now(now) {}
+
+            bool admit(std::uint64_t& suppressed) noexcept
+            {
+                std::int64_t const now = _now();
+                std::int64_t full = _full.load(std::memory_order_relaxed);
+                for (;;)
+                {
+                    std::int64_t const next = std::max(full, now) + _interval;
+                    if (next - now > _window)
+                    {
+                        _suppressed.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                    if (_full.compare_exchange_weak(full, next, std::memory_order_relaxed))
+                    {
+                        suppressed = _suppressed.exchange(0, std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+            }
+
+        private:
+            std::int64_t const _interval;
+            // A rate below one per second still lets one call through per interval
+            std::int64_t const _window;
+            clock const _now;
+            std::atomic<std::int64_t> _full{0};
+            std::atomic<std::uint64_t> _suppressed{0};
+        };
+
+        // Lets each call through with the given probability, drawn from a per-thread xorshift generator
+        class sample
+        {
+        public:
+            explicit sample(double probability) noexcept:
+                _threshold(probability >= 1 ? ~std::uint64_t(0)
+                           : probability <= 0 ? 0 : static_cast<std::uint64_t>(probability * 18446744073709551616.0)) {}
+
+            bool admit(std::uint64_t& suppressed) noexcept
+            {
+                thread_local std::uint64_t state = 0x9e3779b97f4a7c15ull ^ reinterpret_cast<std::uintptr_t>(&state);
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                if (state >= _threshold)
+                {
+                    _suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                suppressed = _suppressed.exchange(0, std::memory_order_relaxed);
+                return true;
+            }
+
+        private:
+            std::uint64_t const _threshold;
+            std::atomic<std::uint64_t> _suppressed{0};
+        };
+    }
+
+    // print(args...) if limit lets the call through; returns whether it did. Nothing is formatted
+    // otherwise. A line printed after calls were held back ends with "(N suppressed)" as its last value.
+    template <typename Limit, typename... Ts>
+    bool print_limited(Limit& limit, Ts const&... args)
+    {
+        std::uint64_t suppressed = 0;
+        if (!limit.admit(suppressed))
+        {
+            return false;
+        }
+        if (suppressed == 0)
+        {
+            print(args...);
+        }
+        else if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            std::apply([&](auto const&... values)
+            {
+                print(values..., details::_suppressed{suppressed}, details::_last(args...));
+            }, details::_drop_last(std::forward_as_tuple(args...)));
+        }
+        else
+        {
+            print(args..., details::_suppressed{suppressed});
+        }
+        return true;
+    }
+
+    // print(...) from this call site limited to every n-th call, the first n calls, rate calls per second,
+    // or a random fraction probability of calls, each counted per call site
+#define PYPRINT_LIMITED_(kind, arg, ...) \
+    do \
+    { \
+        static ::pyprint::limit::kind pyprint_limit_(arg); \
+        ::pyprint::print_limited(pyprint_limit_, __VA_ARGS__); \
+    } while (false)
+#define PYPRINT_EVERY_N(n, ...) PYPRINT_LIMITED_(every_n, n, __VA_ARGS__)
+#define PYPRINT_FIRST_N(n, ...) PYPRINT_LIMITED_(first_n, n, __VA_ARGS__)
+#define PYPRINT_AT_MOST_PER_SECOND(rate, ...) PYPRINT_LIMITED_(per_second, rate, __VA_ARGS__)
+#define PYPRINT_P(probability, ...) PYPRINT_LIMITED_(sample, probability, __VA_ARGS__)
+    // Returns exactly what print(args...) would write; params::out is not used
+    template <typename... Ts>
+    std::string format(Ts const&... args)
+    {
+        if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            return details::_format_with([](std::string_view s) { return std::string(s); }, args...);
+        }
+        else
+        {
+            return format(args..., params{});
+        }
+    }
+
+    // Writes what print(args...) would write to out, returning the iterator past the last char
+    template <typename OutputIt, typename... Ts>
+    OutputIt format_to(OutputIt out, Ts const&... args)
+    {
+        if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            return details::_format_with([&out](std::string_view s) { return std::copy(s.begin(), s.end(), out); }, args...);
+        }
+        else
+        {
+            return format_to(out, args..., params{});
+        }
+    }
+
+    // Result of format_to_n: where writing stopped, and the length of the whole output
+    template <typename OutputIt>
+    struct format_to_n_result
+    {
+        OutputIt out;
+        std::size_t size;
+    };
+
+    // Writes at most n chars of what format(args...) returns to out, such as a caller-supplied span
+    template <typename OutputIt, typename... Ts>
+    format_to_n_result<OutputIt> format_to_n(OutputIt out, std::size_t n, Ts const&... args)
+    {
+        if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            return details::_format_with([&out, n](std::string_view s)
+            {
+                return format_to_n_result<OutputIt>{std::copy_n(s.begin(), std::min(n, s.size()), out), s.size()};
+            }, args...);
+        }
+        else
+        {
+            return format_to_n(out, n, args..., params{});
+        }
+    }
+
+    // Exact number of chars print(args...) would write to params::out (or params::to), so room can be
+    // reserved before formatting. Integers, strings, bitsets and containers of them are counted without
+    // being formatted; floats, operator<< and formatter types are formatted to be measured.
+    template <typename... Ts>
+    std::size_t measure(Ts const&... args)
+    {
+        if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            return details::_measure_line(details::_format_source(details::_last(args...)), args...);
+        }
+        else
+        {
+            return measure(args..., params{});
+        }
+    }
+
+    // Number of chars format(args...) returns; like measure, but with default formatting
+    template <typename... Ts>
+    std::size_t formatted_size(Ts const&... args)
+    {
+        if constexpr (traits::ends_with_params_v<Ts...>)
+        {
+            return details::_measure_line(nullptr, args...);
+        }
+        else
+        {
+            return formatted_size(args..., params{});
+        }
+    }
+
+    // A begin iterator and an end iterator or sentinel, printed like a container
+    template <typename It, typename Sentinel = It>
+    struct range_view
+    {
+        It first;
+        Sentinel last;
+
+        It begin() const { return first; }
+        Sentinel end() const { return last; }
+    };
+
+    template <typename It, typename Sentinel>
+    range_view<It, Sentinel> range(It first, Sentinel last)
+    {
+        return {first, last};
+    }
+
+    namespace details
+    {
+        // What a value's cached text depends on besides the value: where it is, its type and how it is formatted
+        struct _render_key
+        {
+            void const* object;
+            void const* type;
+            std::size_t max_items;
+            std::size_t edge_items;
+            std::size_t depth_left;
+            bitset_format bits;
+            bool binary;
+
+            bool operator==(_render_key const& other) const noexcept
+            {
+                return object == other.object && type == other.type && max_items == other.max_items
+                    && edge_items == other.edge_items && depth_left == other.depth_left && bits == other.bits
+                    && binary == other.binary;
+            }
+        };
+
+        struct _render_key_hash
+        {
+            std::size_t operator()(_render_key const& key) const noexcept
+            {
+                std::size_t h = reinterpret_cast<std::uintptr_t>(key.object);
+                for (std::size_t part : {reinterpret_cast<std::uintptr_t>(key.type), key.max_items, key.edge_items,
+                                         key.depth_left, static_cast<std::size_t>(key.bits), std::size_t(key.binary)})
+                {
+                    h ^= part + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+                }
+                return h;
+            }
+        };
+
+        // One address per type, so objects of different types at the same address get different keys
+        template <typename T>
+        inline constexpr char _type_tag = 0;
+    }
+
+    // Printed text of values wrapped in cached(), kept up to capacity bytes and dropped least recently used
+    // first. Each object keeps one entry, replaced when its version or size changes. Lookups from several
+    // threads are safe; copying the text out happens outside the lock.
+    class render_cache
+    {
+    public:
+        static constexpr std::size_t default_capacity = std::size_t(1) << 24;
+
+        explicit render_cache(std::size_t capacity = default_capacity): _capacity(capacity) {}
+
+        render_cache(render_cache const&) = delete;
+        render_cache& operator=(render_cache const&) = delete;
+
+        // Drop every entry
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _entries.clear();
+            _index.clear();
+            _bytes = 0;
+        }
+
+        // Bytes of text currently held
+        std::size_t bytes() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _bytes;
+        }
+
+        // Prints that reused held text, and prints that had to format the value
+        std::uint64_t hits() const noexcept
+        {
+            return _hits.load(std::memory_order_relaxed);
+        }
+
+        std::uint64_t misses() const noexcept
+        {
+            return _misses.load(std::memory_order_relaxed);
+        }
+
+    private:
+        template <typename T>
+        friend void details::_print_cached(details::context& ctx, cached_view<T> const& view, params const& p);
+
+        struct entry
+        {
+            details::_render_key key;
+            std::uint64_t version;
+            std::size_t size;
+            std::shared_ptr<std::string const> text;
+        };
+
+        // Text held for key at this version and size, or null
+        std::shared_ptr<std::string const> _find(details::_render_key const& key, std::uint64_t version, std::size_t size)
+        {
+            std::shared_ptr<std::string const> text;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto const found = _index.find(key);
+                if (found != _index.end() && found->second->version == version && found->second->size == size)
+                {
+                    _entries.splice(_entries.begin(), _entries, found->second);
+                    text = found->second->text;
+                }
+            }
+            (text ? _hits : _misses).fetch_add(1, std::memory_order_relaxed);
+            return text;
+        }
+
+        void _store(details::_render_key const& key, std::uint64_t version, std::size_t size, std::string_view text)
+        {
+            if (text.size() > _capacity)
+            {
+                return;
+            }
+            auto held = std::make_shared<std::string const>(text);
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto const found = _index.find(key);
+            if (found != _index.end())
+            {
+                _bytes -= found->second->text->size();
+                _entries.erase(found->second);
+                _index.erase(found);
+            }
+            _entries.push_front(entry{key, version, size, std::move(held)});
+            _index.emplace(key, _entries.begin());
+            _bytes += text.size();
+            while (_bytes > _capacity)
+            {
+                entry const& oldest = _entries.back();
+                _bytes -= oldest.text->size();
+                _index.erase(oldest.key);
+                _entries.pop_back();
+            }
+        }
+
+        std::size_t const _capacity;
+        mutable std::mutex _mutex;
+        // Most recently used first
+        std::list<entry> _entries;
+        std::unordered_map<details::_render_key, std::list<entry>::iterator, details::_render_key_hash> _index;
+        std::size_t _bytes = 0;
+        std::atomic<std::uint64_t> _hits{0};
+        std::atomic<std::uint64_t> _misses{0};
+    };
+
+    // Cache used by cached() when none is given
+    inline render_cache& default_render_cache()
+    {
+        static render_cache cache;
+        return cache;
+    }
+
+    // A value printed from cache while its version and size stay the same (see cached)
+    template <typename T>
+    struct cached_view
+    {
+        T const* value;
+        std::uint64_t version;
+        render_cache* cache;
+    };
+
+    // Print value from text kept in cache, formatting it only the first time and whenever version, its size
+    // or the print limits change: print(cached(table, table_version)). The caller bumps version whenever it
+    // modifies value in place. Values are looked up by address, so a different object at the address of one
+    // that was destroyed needs a different version. With non-default stream state (std::hex, precision)
+    // values are formatted every time.
+    template <typename T>
+    cached_view<T> cached(T const& value, std::uint64_t version, render_cache& cache = default_render_cache())
+    {
+        return {&value, version, &cache};
+    }
+
+    namespace details
+    {
+        template <typename T>
+        void _print_cached(context& ctx, cached_view<T> const& view, params const& p)
+        {
+            if (!ctx.fast)
+            { // The text would depend on stream state the key does not hold
+                _print(ctx, *view.value, p);
+                return;
+            }
+            std::size_t size = 0;
+            if constexpr (has_size_v<T>)
+            {
+                size = static_cast<std::size_t>(std::size(*view.value));
+            }
+            std::size_t const depth_left = ctx.max_depth == 0 ? std::numeric_limits<std::size_t>::max()
+                                         : ctx.max_depth > ctx.depth ? ctx.max_depth - ctx.depth : 0;
+            _render_key const key{view.value, &_type_tag<T>, ctx.max_items, ctx.edge_items, depth_left, ctx.bits,
+                                  ctx.binary};
+            if (auto const text = view.cache->_find(key, view.version, size))
+            {
+                ctx.buf.append(text->data(), text->size());
+                return;
+            }
+            std::size_t const start = ctx.buf.size();
+            _print(ctx, *view.value, p);
+            view.cache->_store(key, view.version, size, std::string_view(ctx.buf.data() + start, ctx.buf.size() - start));
+        }
+    }
+
+    // Print range as [a,b,c] followed by params::end, reading each element once as it is produced and writing
+    // the line out, flushed, in pieces of about piece bytes, so memory stays bounded however long the range
+    // is. Only needs begin() and end() on a non-const range, so generators and lazy views work. With
+    // params::max_items set, at most max_items elements are read; a single-pass range of unknown length
+    // shows edge_items elements and then "..." as soon as one more follows, since what is written cannot
+    // be taken back. Pieces of one line may interleave with
+    // other output, even with params::atomic. MessagePack puts an array's length first, so there a range
+    // whose length is not known up front is held until it ends.
+    template <typename Range>
+    void stream_print(Range&& range, params const& p = {}, std::size_t piece = std::size_t(1) << 16)
+    {
+        using iterator = decltype(std::begin(range));
+        static_assert(traits::is_input_iterator_v<iterator>, "stream_print needs a range of input iterators");
+        std::ptrdiff_t count = -1;
+        if constexpr (traits::has_size_v<std::remove_reference_t<Range>>)
+        {
+            count = static_cast<std::ptrdiff_t>(std::size(range));
+        }
+        details::buffer_lease lease;
+        details::context ctx(lease.get(), lease.scratch(), details::_format_source(p), p);
+        details::_item_streamer items{ctx, p, piece};
+        std::size_t at = 0;
+        if (ctx.binary)
+        { // The array's length comes first, so a range of unknown length is held until it ends
+            details::_pack_array_header(ctx.buf, 1);
+            if (count >= 0 && (p.max_items == 0 || static_cast<std::size_t>(count) <= p.max_items))
+            {
+                details::_pack_array_header(ctx.buf, static_cast<std::size_t>(count));
+            }
+            else
+            {
+                at = details::_pack_placeholder(ctx.buf, 0xdd);
+                items.hold = true;
+            }
+        }
+        else
+        {
+            ctx.put('[');
+        }
+        ++ctx.depth;
+        details::_visit_items(ctx, std::begin(range), std::end(range), count, details::identity{}, items);
+        --ctx.depth;
+        if (ctx.binary)
+        {
+            if (at != 0)
+            {
+                details::_pack_patch(ctx.buf, at, items.count);
+            }
+            details::_commit_line(ctx, p);
+            return;
+        }
+        ctx.put(']');
+        ctx.write(p.end);
+        details::_commit_line(ctx, p);
+    }
+
+    // Writes print output from a background thread. Lines are formatted on the calling thread and their bytes
+    // pushed into a preallocated lock-free ring (multi-producer, single-consumer) that the writer thread drains
+    // to each line's stream. Everything accepted is written before the destructor returns.
+    class async_printer
+    {
+    public:
+        // What print does when the ring is full
+        enum class overflow
+        {
+            block, // wait for the writer to make room
+            drop,  // discard the line and count it in dropped()
+            grow,  // queue the line in an unbounded overflow list
+        };
+
+        struct options
+        {
+            // Number of slots, rounded up to a power of two
+            std::size_t capacity = 4096;
+            overflow when_full = overflow::block;
+        };
+
+        async_printer(): async_printer(options{}) {}
+
+        explicit async_printer(options opts): _when_full(opts.when_full)
+        {
+            std::size_t capacity = 2;
+            while (capacity < opts.capacity)
+            {
+                capacity *= 2;
+            }
+            _mask = capacity - 1;
+            _slots.reset(new slot[capacity]);
+            for (std::size_t i = 0; i < capacity; ++i)
+            {
+                _slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            _writer = std::thread([this] { _run(); });
+        }
+
+        ~async_printer()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_wake_mutex);
+                _stopping = true;
+            }
+            _wake.notify_one();
+            _writer.join();
+        }
+
+        async_printer(async_printer const&) = delete;
+        async_printer& operator=(async_printer const&) = delete;
+
+        // Format like pyprint::print and queue the line for the writer thread; lines for params::to are
+        // written to the sink straight away
+        template <typename... Ts>
+        void print(Ts const&... args)
+        {
+            if constexpr (traits::ends_with_params_v<Ts...>)
+            {
+                auto const& p = std::get<sizeof...(args) - 1>(std::forward_as_tuple(args...));
+                details::_call_stats call;
+                details::buffer_lease lease;
+                // Other threads may print to out meanwhile, so its format state is read and updated under its
+                // format_lock; that is never held across a write, so a slow stream does not hold this thread up
+                details::context ctx(lease.get(), lease.scratch(), details::_format_source(p), p, true);
+                details::_format_line(ctx, args...);
+                call.formatted(ctx.buf.size());
+                if (p.to)
+                { // Sinks batch and serialize their own writes, so the line goes to the sink here
+                    details::_write_line(*p.to, ctx.view(), p);
+                }
+                else
+                {
+                    {
+                        std::unique_lock<std::mutex> written;
+                        if (ctx.failed())
+                        { // The writer reads out's failure bits as it writes
+                            written = std::unique_lock<std::mutex>(details::stream_lock(p.out));
+                        }
+                        std::lock_guard<std::mutex> lock(details::format_lock(p.out));
+                        ctx.sync_state(p.out);
+                    }
+                    submit(p.out, ctx.view(), p.flush);
+                }
+                for (destination const& d : p.tee)
+                { // Tee streams share this writer thread; sinks write here
+                    if (d.stream)
+                    {
+                        submit(*d.stream, ctx.view(), p.flush);
+                    }
+                    else if (d.to)
+                    {
+                        details::_write_line(*d.to, ctx.view(), p);
+                    }
+                    else
+                    {
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                print(args..., params{});
+            }
+        }
+
+        // Queue already formatted bytes for out
+        void submit(std::ostream& out, std::string_view bytes, bool flush = false)
+        {
+            std::uint64_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                if (_spilling.load(std::memory_order_acquire) && _spill(out, bytes, flush))
+                {
+                    return;
+                }
+                slot& s = _slots[pos & _mask];
+                std::uint64_t const sequence = s.sequence.load(std::memory_order_acquire);
+                auto const diff = static_cast<std::int64_t>(sequence - pos);
+                if (diff == 0)
+                {
+                    if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        s.fill(out, bytes, flush);
+                        s.sequence.store(pos + 1, std::memory_order_release);
+                        _accepted();
+                        return;
+                    }
+                }
+                else if (diff < 0)
+                { // Full
+                    if (_when_full == overflow::drop)
+                    {
+                        _dropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    if (_when_full == overflow::grow)
+                    {
+                        _spilling.store(true, std::memory_order_release);
+                        continue;
+                    }
+                    _notify();
+                    std::this_thread::yield();
+                    pos = _enqueue_pos.load(std::memory_order_relaxed);
+                }
+                else
+                {
+                    pos = _enqueue_pos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Wait until every line accepted so far has been written and its stream flushed
+        void drain()
+        {
+            std::uint64_t const target = _submitted.load(std::memory_order_acquire);
+            std::unique_lock<std::mutex> lock(_wake_mutex);
+            _drained.wait(lock, [&] { return _flushed >= target; });
+        }
+
+        std::uint64_t written() const noexcept { return _written.load(std::memory_order_relaxed); }
+        std::uint64_t dropped() const noexcept { return _dropped.load(std::memory_order_relaxed); }
+
+    private:
+        struct alignas(64) slot
+        {
+            static constexpr std::size_t inline_size = 192;
+
+            std::atomic<std::uint64_t> sequence{0};
+            std::ostream* out = nullptr;
+            std::size_t size = 0;
+            bool flush = false;
+            std::unique_ptr<char[]> heap; // lines longer than inline_size
+            char bytes[inline_size];
+
+            void fill(std::ostream& to, std::string_view line, bool flush_after)
+            {
+                out = &to;
+                size = line.size();
+                flush = flush_after;
+                char* target = bytes;
+                if (line.size() > inline_size)
+                {
+                    heap.reset(new char[line.size()]);
+                    target = heap.get();
+                }
+                std::memcpy(target, line.data(), line.size());
+            }
+
+            std::string_view view() const noexcept
+            {
+                return {heap ? heap.get() : bytes, size};
+            }
+        };
+
+        struct spilled_line
+        {
+            std::ostream* out;
+            std::string bytes;
+            bool flush;
+            // Ring positions claimed before this line, which are written first
+            std::uint64_t ring_end;
+        };
+
+        void _accepted()
+        {
+            _submitted.fetch_add(1);
+            if (_sleeping.load())
+            {
+                _notify();
+            }
+        }
+
+        void _notify()
+        {
+            std::lock_guard<std::mutex> lock(_wake_mutex);
+            _wake.notify_one();
+        }
+
+        // Queue into the overflow list while it is in use; false once the writer has emptied it
+        bool _spill(std::ostream& out, std::string_view bytes, bool flush)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_spill_mutex);
+                if (!_spilling.load(std::memory_order_relaxed))
+                {
+                    return false;
+                }
+                _spilled.push_back(spilled_line{&out, std::string(bytes), flush, _enqueue_pos.load()});
+            }
+            _accepted();
+            return true;
+        }
+
+        void _write(std::ostream& out, std::string_view bytes, bool flush)
+        {
+            {
+                std::lock_guard<std::mutex> lock(details::stream_lock(out));
+                out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+                if (flush)
+                {
+                    out.flush();
+                }
+            }
+            if (std::find(_touched.begin(), _touched.end(), &out) == _touched.end())
+            {
+                _touched.push_back(&out);
+            }
+            _written.fetch_add(1, std::memory_order_release);
+        }
+
+        // Write everything currently queued; returns whether anything was written
+        bool _drain_once()
+        {
+            bool any = false;
+            for (;;)
+            {
+                slot& s = _slots[_dequeue_pos & _mask];
+                if (s.sequence.load(std::memory_order_acquire) != _dequeue_pos + 1)
+                {
+                    break;
+                }
+                _write(*s.out, s.view(), s.flush);
+                s.heap.reset();
+                s.sequence.store(_dequeue_pos + _mask + 1, std::memory_order_release);
+                ++_dequeue_pos;
+                any = true;
+            }
+            if (_spilling.load(std::memory_order_acquire))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(_spill_mutex);
+                    if (_backlog_at == _backlog.size())
+                    {
+                        _backlog.clear();
+                        _backlog_at = 0;
+                        _backlog.swap(_spilled);
+                    }
+                    else
+                    {
+                        std::move(_spilled.begin(), _spilled.end(), std::back_inserter(_backlog));
+                        _spilled.clear();
+                    }
+                    if (_backlog.empty())
+                    { // Everything spilled is written, so new lines can use the ring again
+                        _spilling.store(false, std::memory_order_release);
+                    }
+                }
+                // A spilled line waits for the ring lines claimed before it, which include every earlier
+                // line from its thread; one still being filled stops the list until it is published
+                for (; _backlog_at != _backlog.size() && _backlog[_backlog_at].ring_end <= _dequeue_pos; ++_backlog_at)
+                {
+                    spilled_line& line = _backlog[_backlog_at];
+                    _write(*line.out, line.bytes, line.flush);
+                    line.bytes = std::string();
+                    any = true;
+                }
+            }
+            return any;
+        }
+
+        // Nothing is queued or being queued in the ring or the overflow list
+        bool _idle() const
+        {
+            return _enqueue_pos.load(std::memory_order_acquire) == _dequeue_pos
+                && !_spilling.load(std::memory_order_acquire);
+        }
+
+        // Flush every stream written since the queue last ran empty
+        void _flush_touched()
+        {
+            for (auto* out : _touched)
+            {
+                std::lock_guard<std::mutex> lock(details::stream_lock(*out));
+                out->flush();
+            }
+            _touched.clear();
+        }
+
+        void _run()
+        {
+            for (;;)
+            { // Lines are counted as accepted only once queued, so once the queue is empty all of these are written
+                std::uint64_t const accepted = _submitted.load(std::memory_order_acquire);
+                if (_drain_once())
+                {
+                    continue;
+                }
+                bool const idle = _idle();
+                if (idle)
+                {
+                    _flush_touched();
+                }
+                std::unique_lock<std::mutex> lock(_wake_mutex);
+                if (idle && accepted > _flushed)
+                {
+                    _flushed = accepted;
+                    _drained.notify_all();
+                }
+                if (_stopping)
+                {
+                    lock.unlock();
+                    while (_drain_once() || !_idle())
+                    {
+                        std::this_thread::yield();
+                    }
+                    _flush_touched();
+                    return;
+                }
+                // A producer counts its line, then checks _sleeping; checking the count after setting _sleeping
+                // means either this sees the line or the producer sees the flag and wakes this thread
+                _sleeping.store(true);
+                if (_submitted.load() == accepted)
+                {
+                    _wake.wait(lock);
+                }
+                _sleeping.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        overflow const _when_full;
+        std::size_t _mask = 0;
+        std::unique_ptr<slot[]> _slots;
+        alignas(64) std::atomic<std::uint64_t> _enqueue_pos{0};
+        alignas(64) std::uint64_t _dequeue_pos = 0;
+        std::vector<std::ostream*> _touched;
+        std::atomic<std::uint64_t> _submitted{0};
+        std::atomic<std::uint64_t> _written{0};
+        std::atomic<std::uint64_t> _dropped{0};
+        std::atomic<bool> _sleeping{false};
+        std::atomic<bool> _spilling{false};
+        std::mutex _spill_mutex;
+        std::vector<spilled_line> _spilled;
+        // Spilled lines taken by the writer, from _backlog_at on still waiting for earlier ring lines
+        std::vector<spilled_line> _backlog;
+        std::size_t _backlog_at = 0;
+        std::mutex _wake_mutex;
+        std::condition_variable _wake;
+        std::condition_variable _drained;
+        // Lines accepted, written and flushed, as a count of _submitted; guarded by _wake_mutex
+        std::uint64_t _flushed = 0;
+        bool _stopping = false;
+        std::thread _writer;
+    };
+
+    namespace details
+    {
+        inline void _submit(async_printer& printer, std::ostream& out, std::string_view bytes, bool flush)
+        {
+            printer.submit(out, bytes, flush);
+        }
+    }
+
+    // Printer used by async_print; created on first use and drained at exit
+    inline async_printer& default_async_printer()
+    {
+        static async_printer printer;
+        return printer;
+    }
+
+    // Like print, but the write to params::out happens on a background thread
+    template <typename... Ts>
+    void async_print(Ts const&... args)
+    {
+        default_async_printer().print(args...);
+    }
+
+    namespace details
+    {
+        // Start of each deferred record; the params and arguments follow, each aligned for its type
+        struct _deferred_header
+        {
+            void (*render)(unsigned char const* record);
+            std::size_t size;
+        };
+
+        // Storage for records, in steps of the strictest fundamental alignment
+        struct alignas(std::max_align_t) _deferred_unit
+        {
+            unsigned char bytes[alignof(std::max_align_t)];
+        };
+
+        template <std::size_t N>
+        struct _deferred_layout
+        {
+            std::size_t offsets[N];
+            std::size_t size;
+        };
+
+        // Where each of Ts goes in a record, and the record's size rounded up so the next one stays aligned
+        template <typename... Ts>
+        constexpr _deferred_layout<sizeof...(Ts)> _deferred_offsets() noexcept
+        {
+            _deferred_layout<sizeof...(Ts)> layout{};
+            std::size_t at = sizeof(_deferred_header);
+            std::size_t i = 0;
+            ((at = (at + alignof(Ts) - 1) / alignof(Ts) * alignof(Ts), layout.offsets[i++] = at, at += sizeof(Ts)), ...);
+            layout.size = (at + sizeof(_deferred_unit) - 1) / sizeof(_deferred_unit) * sizeof(_deferred_unit);
+            return layout;
+        }
+
+        template <typename T>
+        T const& _deferred_at(unsigned char const* record, std::size_t offset) noexcept
+        {
+            return *std::launder(reinterpret_cast<T const*>(record + offset));
+        }
+
+        // Render function for one signature: the same print call, made from the copies in the record
+        template <typename... Ts, std::size_t... I>
+        void _render_deferred(unsigned char const* record, std::index_sequence<I...>)
+        {
+            constexpr auto layout = _deferred_offsets<params, Ts...>();
+            print(_deferred_at<Ts>(record, layout.offsets[I + 1])..., _deferred_at<params>(record, layout.offsets[0]));
+        }
+
+        template <typename... Ts>
+        void _render_deferred(unsigned char const* record)
+        {
+            _render_deferred<Ts...>(record, std::index_sequence_for<Ts...>{});
+        }
+    }
+
+    // Records print calls on a hot thread and formats them later. defer() copies the arguments and params
+    // into a compact record with a pointer to the render function for their types, and drain() formats
+    // and writes every recorded line in order, byte for byte as print would have. Arguments must be
+    // trivially copyable: numbers, pointers, bitsets, std::array of scalars. Pointers, including strings
+    // passed as char const* or as character arrays, are kept as pointers, so what they point to must
+    // still be there when the line is drained; string literals always are. Records hold function
+    // pointers, so only the program that made them can drain them.
+    class deferred_log
+    {
+    public:
+        static constexpr std::size_t default_reserve = std::size_t(64) << 10;
+
+        // Room for reserve bytes of records is allocated up front, for the records and again for the batch
+        // being drained; the two swap in drain, so each keeps its capacity
+        explicit deferred_log(std::size_t reserve = default_reserve)
+        {
+            std::size_t const units = (reserve + sizeof(details::_deferred_unit) - 1) / sizeof(details::_deferred_unit);
+            _records.reserve(units);
+            _draining.reserve(units);
+        }
+
+        // Lines deferred and not yet drained are written out
+        ~deferred_log()
+        {
+            drain();
+        }
+
+        deferred_log(deferred_log const&) = delete;
+        deferred_log& operator=(deferred_log const&) = delete;
+
+        // Copies the record under a lock shared with other threads' defer and with drain's swap, held only
+        // for the copy. Once more than the reserved bytes are pending, a record can grow the buffer, which
+        // copies every pending record while the lock is held.
+        template <typename... Ts>
+        void defer(Ts const&... args)
+        {
+            if constexpr (traits::ends_with_params_v<Ts...>)
+            {
+                auto const& p = std::get<sizeof...(args) - 1>(std::forward_as_tuple(args...));
+                std::apply([&](auto const&... values) { _record(p, values...); },
+                           details::_drop_last(std::forward_as_tuple(args...)));
+            }
+            else
+            {
+                defer(args..., params{});
+            }
+        }
+
+        // Format and write every line deferred so far; returns how many there were
+        std::size_t drain()
+        {
+            std::lock_guard<std::mutex> draining(_drain_mutex);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _draining.swap(_records);
+            }
+            std::size_t lines = 0;
+            auto const* record = reinterpret_cast<unsigned char const*>(_draining.data());
+            auto const* const end = record + _draining.size() * sizeof(details::_deferred_unit);
+            try
+            {
+                while (record != end)
+                {
+                    auto const& header = details::_deferred_at<details::_deferred_header>(record, 0);
+                    record += header.size;
+                    ++lines;
+                    header.render(record - header.size);
+                }
+            }
+            catch (...)
+            { // The rest of the batch is lost with the failing line
+                _draining.clear();
+                throw;
+            }
+            _draining.clear();
+            return lines;
+        }
+
+        // Bytes of records waiting to be drained
+        std::size_t pending_bytes() const
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _records.size() * sizeof(details::_deferred_unit);
+        }
+
+    private:
+        template <typename... Ts>
+        void _record(params const& p, Ts const&... args)
+        {
+            _append<std::decay_t<Ts const>...>(p, args...);
+        }
+
+        // Arrays decay here: a character array is kept as a pointer to its first character
+        template <typename... Stored, typename... Ts>
+        void _append(params const& p, Ts const&... args)
+        {
+            static_assert((std::is_trivially_copyable_v<Stored> && ...),
+                          "Deferred arguments must be trivially copyable; format other types with print.");
+            static_assert((!std::is_same_v<Stored, params> && ...), "params must be the last argument.");
+            static_assert(((alignof(Stored) <= alignof(std::max_align_t)) && ...), "Over-aligned arguments cannot be deferred.");
+            constexpr auto layout = details::_deferred_offsets<params, Stored...>();
+            details::_deferred_header const header{&details::_render_deferred<Stored...>, layout.size};
+            std::lock_guard<std::mutex> lock(_mutex);
+            std::size_t const at = _records.size();
+            _records.resize(at + layout.size / sizeof(details::_deferred_unit));
+            auto* const record = reinterpret_cast<unsigned char*>(_records.data() + at);
+            std::memcpy(record, &header, sizeof(header));
+            std::memcpy(record + layout.offsets[0], &p, sizeof(params));
+            std::size_t i = 1;
+            ([&](Stored const stored) { std::memcpy(record + layout.offsets[i++], &stored, sizeof(Stored)); }(args), ...);
+        }
+
+        mutable std::mutex _mutex;
+        std::vector<details::_deferred_unit> _records;
+        // Taken by drain, so lines keep their order when several threads drain at once
+        std::mutex _drain_mutex;
+        std::vector<details::_deferred_unit> _draining;
+    };
+
+    // Log used by defer; created on first use and drained at exit
+    inline deferred_log& default_deferred_log()
+    {
+        static deferred_log log;
+        return log;
+    }
+
+    // Like print, but only copies the arguments; the line is formatted by default_deferred_log().drain()
+    template <typename... Ts>
+    void defer(Ts const&... args)
+    {
+        default_deferred_log().defer(args...);
     }
 
 }
 
-#endif //PYPRINT_PYPRINT_H
\ No newline at end of file
+#endif //PYPRINT_PYPRINT_H
@@ -0,0 +1,430 @@
+//
+// Created on 2026/10/16.
+//
+
+#ifndef PYPRINT_MSGPACK_H
+#define PYPRINT_MSGPACK_H
+
+#include "pyprint.h"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace pyprint::msgpack
+{
+    // Thrown when the bytes do not hold a value of the requested type
+    class decode_error: public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    // Reads back what print writes with params{.encode = encoding::msgpack}. Each print call is read as the
+    // tuple of its arguments, and each value into the type it was printed from or any type of the same
+    // shape: a container or std::array for an array or typed array, a pair or tuple for an array of that
+    // length, std::string for a str. Container adapters come back as the sequence they print as.
+    class reader
+    {
+    public:
+        // The bytes are not copied and must outlive the reader
+        explicit reader(std::string_view bytes) noexcept: _bytes(bytes) {}
+        explicit reader(std::string&&) = delete;
+
+        // Everything has been read
+        bool done() const noexcept
+        {
+            return _at == _bytes.size();
+        }
+
+        // The arguments of one print call
+        template <typename... Ts>
+        std::tuple<Ts...> read_line()
+        {
+            if (_array_size() != sizeof...(Ts))
+            {
+                throw decode_error("pyprint::msgpack: line has a different number of arguments");
+            }
+            return std::tuple<Ts...>{read<Ts>()...};
+        }
+
+        template <typename T>
+        T read()
+        {
+            T value{};
+            _read(value);
+            return value;
+        }
+
+    private:
+        template <typename T, typename = void>
+        struct _is_container: std::false_type {};
+
+        template <typename T>
+        struct _is_container<T, std::void_t<typename T::value_type,
+            decltype(std::declval<T&>().insert(std::declval<T&>().end(), std::declval<typename T::value_type>()))>>:
+            std::true_type {};
+
+        template <typename T>
+        struct _element
+        {
+            using type = T;
+        };
+
+        template <typename K, typename V>
+        struct _element<std::pair<K const, V>>
+        {
+            using type = std::pair<K, V>;
+        };
+
+        [[noreturn]] static void _fail(char const* what)
+        {
+            throw decode_error(std::string("pyprint::msgpack: ") + what);
+        }
+
+        // Truncated containers hold nil where print wrote "..."
+        [[noreturn]] static void _unexpected(unsigned char tag, char const* expected)
+        {
+            _fail(tag == 0xc0 ? "nil (a truncated \"...\") cannot be read as a value" : expected);
+        }
+
+        void _need(std::size_t n) const
+        {
+            if (_bytes.size() - _at < n)
+            {
+                _fail("unexpected end of input");
+            }
+        }
+
+        unsigned char _byte()
+        {
+            _need(1);
+            return static_cast<unsigned char>(_bytes[_at++]);
+        }
+
+        std::uint64_t _be(std::size_t n)
+        {
+            _need(n);
+            std::uint64_t v = 0;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                v = v << 8 | static_cast<unsigned char>(_bytes[_at++]);
+            }
+            return v;
+        }
+
+        std::size_t _array_size()
+        {
+            unsigned char const tag = _byte();
+            if ((tag & 0xf0) == 0x90)
+            {
+                return tag & 0x0f;
+            }
+            if (tag == 0xdc || tag == 0xdd)
+            {
+                return static_cast<std::size_t>(_be(tag == 0xdc ? 2 : 4));
+            }
+            _unexpected(tag, "expected an array");
+        }
+
+        std::string_view _string()
+        {
+            unsigned char const tag = _byte();
+            std::size_t size = 0;
+            if ((tag & 0xe0) == 0xa0)
+            {
+                size = tag & 0x1f;
+            }
+            else if (tag >= 0xd9 && tag <= 0xdb)
+            {
+                size = static_cast<std::size_t>(_be(std::size_t(1) << (tag - 0xd9)));
+            }
+            else
+            {
+                _unexpected(tag, "expected a str");
+            }
+            _need(size);
+            std::string_view const s = _bytes.substr(_at, size);
+            _at += size;
+            return s;
+        }
+
+        // Ext payload of the given type; returns its size and leaves _at at its start
+        std::size_t _ext(std::int8_t type)
+        {
+            unsigned char const tag = _byte();
+            std::size_t size = 0;
+            if (tag >= 0xd4 && tag <= 0xd8)
+            {
+                size = std::size_t(1) << (tag - 0xd4);
+            }
+            else if (tag >= 0xc7 && tag <= 0xc9)
+            {
+                size = static_cast<std::size_t>(_be(std::size_t(1) << (tag - 0xc7)));
+            }
+            else
+            {
+                _unexpected(tag, "expected an ext");
+            }
+            if (static_cast<std::int8_t>(_byte()) != type)
+            {
+                _fail("unexpected ext type");
+            }
+            _need(size);
+            return size;
+        }
+
+        bool _peek_ext(std::int8_t type) const
+        {
+            if (_at >= _bytes.size())
+            {
+                return false;
+            }
+            auto const tag = static_cast<unsigned char>(_bytes[_at]);
+            std::size_t offset = 0;
+            if (tag >= 0xd4 && tag <= 0xd8)
+            {
+                offset = 1;
+            }
+            else if (tag >= 0xc7 && tag <= 0xc9)
+            { // Tag, then a 1, 2 or 4-byte length
+                offset = 1 + (std::size_t(1) << (tag - 0xc7));
+            }
+            else
+            {
+                return false;
+            }
+            return _at + offset < _bytes.size() && static_cast<std::int8_t>(_bytes[_at + offset]) == type;
+        }
+
+        template <typename T>
+        T _number()
+        {
+            unsigned char const tag = _byte();
+            if (tag < 0x80)
+            {
+                return static_cast<T>(tag);
+            }
+            if (tag >= 0xe0)
+            {
+                return static_cast<T>(static_cast<signed char>(tag));
+            }
+            switch (tag)
+            {
+            case 0xcc: return static_cast<T>(_be(1));
+            case 0xcd: return static_cast<T>(_be(2));
+            case 0xce: return static_cast<T>(_be(4));
+            case 0xcf: return static_cast<T>(_be(8));
+            case 0xd0: return static_cast<T>(static_cast<std::int8_t>(_be(1)));
+            case 0xd1: return static_cast<T>(static_cast<std::int16_t>(_be(2)));
+            case 0xd2: return static_cast<T>(static_cast<std::int32_t>(_be(4)));
+            case 0xd3: return static_cast<T>(static_cast<std::int64_t>(_be(8)));
+            case 0xca:
+            {
+                auto const bits = static_cast<std::uint32_t>(_be(4));
+                float f;
+                std::memcpy(&f, &bits, sizeof(f));
+                return static_cast<T>(f);
+            }
+            case 0xcb:
+            {
+                std::uint64_t const bits = _be(8);
+                double d;
+                std::memcpy(&d, &bits, sizeof(d));
+                return static_cast<T>(d);
+            }
+            default:
+                _unexpected(tag, "expected a number");
+            }
+        }
+
+        // One little-endian element of a typed array, stored as E
+        template <typename E, typename T>
+        static T _typed(char const* in)
+        {
+            E e;
+            if constexpr (details::_little_endian)
+            {
+                std::memcpy(&e, in, sizeof(E));
+            }
+            else
+            {
+                char swapped[sizeof(E)];
+                std::reverse_copy(in, in + sizeof(E), swapped);
+                std::memcpy(&e, swapped, sizeof(E));
+            }
+            return static_cast<T>(e);
+        }
+
+        // Call add(value) for each element of the typed array at _at, converted to T
+        template <typename T, typename Add>
+        void _typed_array(Add&& add)
+        {
+            std::size_t const size = _ext(typed_array_ext);
+            if (size == 0)
+            {
+                _fail("empty typed array");
+            }
+            char const code = _bytes[_at];
+            std::size_t width = 0;
+            T (*element)(char const*) = nullptr;
+            switch (code)
+            {
+            case 'b': width = 1; element = &_typed<std::int8_t, T>; break;
+            case 'B': width = 1; element = &_typed<std::uint8_t, T>; break;
+            case 'h': width = 2; element = &_typed<std::int16_t, T>; break;
+            case 'H': width = 2; element = &_typed<std::uint16_t, T>; break;
+            case 'i': width = 4; element = &_typed<std::int32_t, T>; break;
+            case 'I': width = 4; element = &_typed<std::uint32_t, T>; break;
+            case 'q': width = 8; element = &_typed<std::int64_t, T>; break;
+            case 'Q': width = 8; element = &_typed<std::uint64_t, T>; break;
+            case 'f': width = 4; element = &_typed<float, T>; break;
+            case 'd': width = 8; element = &_typed<double, T>; break;
+            default: _fail("unknown typed array element");
+            }
+            if ((size - 1) % width != 0)
+            {
+                _fail("typed array size is not a multiple of its element");
+            }
+            char const* in = _bytes.data() + _at + 1;
+            _at += size;
+            for (std::size_t i = 0; i < (size - 1) / width; ++i)
+            {
+                add(element(in + i * width));
+            }
+        }
+
+        template <typename... Ts, std::size_t... I>
+        void _read_tuple(std::tuple<Ts...>& value, std::index_sequence<I...>)
+        {
+            (_read(std::get<I>(value)), ...);
+        }
+
+        template <typename T>
+        void _read(T& value)
+        {
+            if constexpr (std::is_same_v<T, bool>)
+            {
+                unsigned char const tag = _byte();
+                if (tag != 0xc2 && tag != 0xc3)
+                {
+                    _unexpected(tag, "expected a bool");
+                }
+                value = tag == 0xc3;
+            }
+            else if constexpr (std::is_same_v<T, char> || std::is_same_v<T, signed char> || std::is_same_v<T, unsigned char>)
+            {
+                std::string_view const s = _string();
+                if (s.size() != 1)
+                {
+                    _fail("expected a str of one character");
+                }
+                value = static_cast<T>(s[0]);
+            }
+            else if constexpr (std::is_arithmetic_v<T>)
+            {
+                value = _number<T>();
+            }
+            else if constexpr (std::is_same_v<T, std::string>)
+            {
+                value = std::string(_string());
+            }
+            else if constexpr (traits::is_bitset_v<T>)
+            {
+                std::size_t const size = _ext(bitset_ext);
+                if (size < 4 || _be(4) != value.size() || size - 4 != (value.size() + 7) / 8)
+                {
+                    _fail("bitset has a different size");
+                }
+                for (std::size_t i = 0; i < value.size(); ++i)
+                {
+                    value[i] = (static_cast<unsigned char>(_bytes[_at + i / 8]) >> (i % 8)) & 1;
+                }
+                _at += size - 4;
+            }
+            else if constexpr (traits::is_pair_v<T>)
+            {
+                if (_array_size() != 2)
+                {
+                    _fail("expected an array of 2 for a pair");
+                }
+                _read(value.first);
+                _read(value.second);
+            }
+            else if constexpr (traits::is_std_array_v<T>)
+            {
+                std::size_t i = 0;
+                auto const add = [&](auto&& element)
+                {
+                    if (i == value.size())
+                    {
+                        _fail("array has a different size");
+                    }
+                    value[i++] = std::forward<decltype(element)>(element);
+                };
+                if constexpr (std::is_arithmetic_v<typename T::value_type>)
+                {
+                    if (_peek_ext(typed_array_ext))
+                    {
+                        _typed_array<typename T::value_type>(add);
+                        if (i != value.size())
+                        {
+                            _fail("array has a different size");
+                        }
+                        return;
+                    }
+                }
+                if (_array_size() != value.size())
+                {
+                    _fail("array has a different size");
+                }
+                for (auto& element : value)
+                {
+                    _read(element);
+                }
+            }
+            else if constexpr (traits::is_tuple_v<T>)
+            {
+                if (_array_size() != std::tuple_size_v<T>)
+                {
+                    _fail("tuple has a different size");
+                }
+                _read_tuple(value, std::make_index_sequence<std::tuple_size_v<T>>{});
+            }
+            else if constexpr (_is_container<T>::value)
+            {
+                using element = typename _element<typename T::value_type>::type;
+                auto const add = [&value](auto&& item)
+                {
+                    value.insert(value.end(), std::forward<decltype(item)>(item));
+                };
+                if constexpr (std::is_arithmetic_v<element>)
+                {
+                    if (_peek_ext(typed_array_ext))
+                    {
+                        _typed_array<element>(add);
+                        return;
+                    }
+                }
+                for (std::size_t n = _array_size(); n != 0; --n)
+                {
+                    add(read<element>());
+                }
+            }
+            else
+            {
+                static_assert(traits::always_false_v<T>, "Type cannot be read from MessagePack.");
+            }
+        }
+
+        std::string_view _bytes;
+        std::size_t _at = 0;
+    };
+}
+
+#endif //PYPRINT_MSGPACK_H
@@ -3,9 +3,11 @@
 //
 
 #include "../pyprint.h"
+#include "../pyprint_msgpack.h"
 #include <sstream>
 #include <vector>
 #include <list>
+#include <forward_list>
 #include <set>
 #include <map>
 #include <deque>
@@ -14,6 +16,21 @@
 #include <stack>
 #include <queue>
 #include <string>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <cstdlib>
+#include <new>
+#include <charconv>
+#include <numeric>
+#if __cplusplus >= 202002L
+#include <ranges>
+#endif
 
 using namespace pyprint;
 
@@ -21,6 +38,33 @@ using namespace pyprint;
 int g_failed_tests = 0;
 int g_total_tests = 0;
 
+// Every heap allocation in the process, to check that printing does not allocate
+std::atomic<std::size_t> g_allocations{0};
+
+void* operator new(std::size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+// Once inlined next to a new-expression GCC takes this free for a mismatch, but the operator new above uses malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    ::operator delete(ptr);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
 // Helper function to capture output
 template<typename Func>
 std::string capture_output(Func func) {
@@ -42,6 +86,53 @@ void check_result(const std::string& result, const std::string& expected, const
     }
 }
 
+// Types printed through pyprint::formatter rather than operator<<
+struct price {
+    long long cents;
+};
+
+template <>
+struct pyprint::formatter<price> {
+    std::size_t size_hint(price const&) const { return 24; }
+
+    void format(price const& value, appender& out) const {
+        // The sign is written on its own, so -0.50 keeps it even though its whole part is 0
+        unsigned long long const magnitude = value.cents < 0 ? 0ull - static_cast<unsigned long long>(value.cents)
+                                                             : static_cast<unsigned long long>(value.cents);
+        unsigned long long const cents = magnitude % 100;
+        char* first = out.reserve(24);
+        char* last = first;
+        if (value.cents < 0) {
+            *last++ = '-';
+        }
+        last = std::to_chars(last, first + 24, magnitude / 100).ptr;
+        *last++ = '.';
+        *last++ = static_cast<char>('0' + cents / 10);
+        *last++ = static_cast<char>('0' + cents % 10);
+        out.commit(static_cast<std::size_t>(last - first));
+    }
+};
+
+struct order {
+    int id;
+    std::vector<price> fills;
+};
+
+// operator<< is ignored once a formatter exists
+std::ostream& operator<<(std::ostream& os, order const&) {
+    return os << "order via ostream";
+}
+
+template <>
+struct pyprint::formatter<order> {
+    void format(order const& value, appender& out) const {
+        out.append("order#");
+        out.print(value.id);
+        out.push_back(' ');
+        out.print(value.fills);
+    }
+};
+
 // Test basic types
 void test_basic_types() {
     // Test integers
@@ -233,6 +324,29 @@ void test_tuple() {
     std::cout << "Tuple tests passed\n";
 }
 
+// Bitsets render exactly like to_string, whatever the size
+template <std::size_t N>
+void check_bitset_pattern(std::bitset<N> const& bits, const std::string& test_name) {
+    std::string result = capture_output([&bits](std::ostream& os) {
+        print(bits, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, bits.to_string() + "\n", test_name);
+}
+
+template <std::size_t... Ns>
+void check_bitset_sizes() {
+    ([] {
+        std::bitset<Ns> bits;
+        check_bitset_pattern(bits, "bitset<" + std::to_string(Ns) + "> zeros");
+        bits.set();
+        check_bitset_pattern(bits, "bitset<" + std::to_string(Ns) + "> ones");
+        for (std::size_t i = 0; i < Ns; ++i) {
+            bits[i] = (i * 7 + i / 3) % 5 < 2;
+        }
+        check_bitset_pattern(bits, "bitset<" + std::to_string(Ns) + "> pattern");
+    }(), ...);
+}
+
 // Test bitsets
 void test_bitset() {
     std::bitset<8> bs(42); // 00101010
@@ -247,6 +361,25 @@ void test_bitset() {
     });
     check_result(result, "1111\n", "bitset<4>");
 
+    check_bitset_sizes<0, 1, 7, 8, 9, 15, 16, 17, 31, 33, 63, 64, 65, 100, 128, 1000, 65536>();
+
+    std::bitset<10> mask(0x2F5);
+    result = capture_output([&mask](std::ostream& os) {
+        print(mask, std::bitset<8>(0xA5), std::bitset<0>(), params{.sep=" ", .end="\n", .out=os, .flush=false, .bits=bitset_format::grouped});
+    });
+    check_result(result, "10_1111_0101 1010_0101 \n", "grouped bitset");
+
+    result = capture_output([&mask](std::ostream& os) {
+        print(mask, std::bitset<8>(0xA5), std::bitset<1>(1), params{.sep=" ", .end="\n", .out=os, .flush=false, .bits=bitset_format::hex});
+    });
+    check_result(result, "0x2f5 0xa5 0x1\n", "hex bitset");
+
+    result = capture_output([](std::ostream& os) {
+        os << std::setw(6) << std::left;
+        print(std::bitset<8>(0xA5), params{.sep=" ", .end="\n", .out=os, .flush=false, .bits=bitset_format::hex});
+    });
+    check_result(result, "0xa5  \n", "hex bitset honors stream width");
+
     std::cout << "Bitset tests passed\n";
 }
 
@@ -297,6 +430,1461 @@ void test_priority_queue() {
     std::cout << "Priority queue tests passed\n";
 }
 
+// Test adapters are printed in pop order without being modified
+void test_container_adapter_order() {
+    std::stack<int, std::vector<int>> stk;
+    for (int i = 1; i <= 4; ++i) stk.push(i);
+    std::string result = capture_output([&stk](std::ostream& os) {
+        print(stk, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "[4,3,2,1]\n", "stack over vector");
+    check_result(std::to_string(stk.size()) + "\n", "4\n", "stack untouched");
+
+    std::queue<int, std::list<int>> q;
+    for (int i = 1; i <= 4; ++i) q.push(i);
+    result = capture_output([&q](std::ostream& os) {
+        print(q, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "[1,2,3,4]\n", "queue over list");
+
+    std::priority_queue<int, std::vector<int>, std::greater<>> min_pq;
+    for (int x : {5, 1, 4, 1, 3}) min_pq.push(x);
+    result = capture_output([&min_pq](std::ostream& os) {
+        print(min_pq, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "[1,1,3,4,5]\n", "min priority_queue");
+    check_result(std::to_string(min_pq.top()) + "\n", "1\n", "priority_queue untouched");
+
+    std::stack<int> empty_stack;
+    result = capture_output([&empty_stack](std::ostream& os) {
+        print(empty_stack, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "[]\n", "empty stack");
+
+    std::cout << "Container adapter order tests passed\n";
+}
+
+// Test built-in types format exactly as operator<< would on a default stream
+void test_builtin_formatting() {
+    const double doubles[] = {0.0, -0.0, 0.1, 1.0 / 3, 2.5, 100.0, 123456.0, 1234567.0, 1e-5, 1e20, -7.25e-300,
+                              std::numeric_limits<double>::max(), std::numeric_limits<double>::infinity(),
+                              -std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()};
+    for (double d : doubles) {
+        std::ostringstream expected;
+        expected << d << " " << static_cast<float>(d) << " " << static_cast<long double>(d) << "\n";
+        std::string result = capture_output([d](std::ostream& os) {
+            print(d, static_cast<float>(d), static_cast<long double>(d), params{.sep=" ", .end="\n", .out=os, .flush=false});
+        });
+        check_result(result, expected.str(), "floating point matches operator<<");
+    }
+
+    std::ostringstream expected;
+    expected << std::numeric_limits<long long>::min() << " " << std::numeric_limits<unsigned long long>::max()
+             << " " << static_cast<short>(-5) << " " << 'x' << " " << static_cast<unsigned char>('y')
+             << " " << static_cast<int8_t>('z') << " " << false << "\n";
+    std::string result = capture_output([](std::ostream& os) {
+        print(std::numeric_limits<long long>::min(), std::numeric_limits<unsigned long long>::max(),
+              static_cast<short>(-5), 'x', static_cast<unsigned char>('y'), static_cast<int8_t>('z'), false,
+              params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, expected.str(), "integers and characters match operator<<");
+
+    std::cout << "Built-in formatting tests passed\n";
+}
+
+// Test that the stream's formatting state is still honored
+void test_stream_state() {
+    std::string result = capture_output([](std::ostream& os) {
+        os << std::hex << std::showbase;
+        print(255, std::vector<int>{10, 11}, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "0xff [0xa,0xb]\n", "hex stream");
+
+    result = capture_output([](std::ostream& os) {
+        os << std::setprecision(3);
+        print(3.14159, std::pair<double, double>{2.71828, 1.0}, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "3.14 (2.72,1)\n", "precision stream");
+
+    result = capture_output([](std::ostream& os) {
+        os << std::boolalpha;
+        print(true, false, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "true false\n", "boolalpha stream");
+
+    result = capture_output([](std::ostream& os) {
+        os << std::setw(5);
+        print(42, 7, params{.sep=" ", .end="\n", .out=os, .flush=false});
+        print(42, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "   42 7\n42\n", "width applies to the first value only");
+
+    std::cout << "Stream state tests passed\n";
+}
+
+// Type whose operator<< prints through pyprint itself
+struct nested_printer {
+    std::vector<int> values;
+};
+
+std::ostream& operator<<(std::ostream& os, const nested_printer& n) {
+    print("nested", n.values, params{.sep=":", .end="", .out=os, .flush=false});
+    return os;
+}
+
+// Test print called from inside a user operator<< during another print
+void test_reentrant_print() {
+    nested_printer n{{1, 2}};
+    std::string result = capture_output([&n](std::ostream& os) {
+        print("outer", n, 3, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "outer nested:[1,2] 3\n", "print inside operator<<");
+
+    std::cout << "Reentrant print tests passed\n";
+}
+
+// Test rendering to strings and output iterators
+void test_format() {
+    check_result(format(1, "two", 3.0), "1 two 3\n", "format default params");
+    check_result(format(std::vector<int>{1, 2}, std::pair<int, char>{3, 'c'}, params{.sep=", ", .end=""}),
+                 "[1,2], (3,c)", "format custom params");
+    check_result(format(params{.end="!"}), "!", "format only params");
+
+    char out[32] = {};
+    char* last = format_to(out, std::map<int, int>{{1, 2}}, params{.end=""});
+    check_result(std::string(out, last), "[(1,2)]", "format_to char array");
+
+    std::string appended = "x=";
+    format_to(std::back_inserter(appended), 42);
+    check_result(appended, "x=42\n", "format_to back_inserter");
+
+    check_result(std::to_string(formatted_size(123, std::vector<int>{4, 5})) + "\n", "10\n", "formatted_size");
+
+    // format does not pick up the state of std::cout
+    std::cout << std::hex;
+    std::string result = format(255);
+    std::cout << std::dec;
+    check_result(result, "255\n", "format ignores cout state");
+
+    std::cout << "Format tests passed\n";
+}
+
+// String buffer that counts how often it is flushed
+class flush_counting_buffer : public std::stringbuf {
+public:
+    int flushes = 0;
+
+protected:
+    int sync() override {
+        flushes++;
+        return std::stringbuf::sync();
+    }
+};
+
+// Test params::flush and flush_policy batching
+void test_flush() {
+    flush_counting_buffer buf;
+    std::ostream os(&buf);
+    print(1, params{.sep=" ", .end="\n", .out=os, .flush=true});
+    print(2, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    check_result(buf.str() + std::to_string(buf.flushes) + "\n", "1\n2\n1\n", "params flush");
+    print(3, params{" ", "\n", os, true});
+    check_result(buf.str() + std::to_string(buf.flushes) + "\n", "1\n2\n3\n2\n", "positional params");
+
+    flush_counting_buffer batched_buf;
+    std::ostream batched(&batched_buf);
+    {
+        flush_policy every_three(flush_policy::options{.every_n = 3});
+        for (int i = 0; i < 2; ++i) {
+            print(i, params{.sep=" ", .end="\n", .out=batched, .flush=false, .policy=&every_three});
+        }
+        check_result(batched_buf.str() + std::to_string(batched_buf.flushes) + "\n", "0\n", "every_n holds lines back");
+        print(2, params{.sep=" ", .end="\n", .out=batched, .flush=false, .policy=&every_three});
+        check_result(batched_buf.str() + std::to_string(batched_buf.flushes) + "\n", "0\n1\n2\n1\n", "every_n writes batch");
+        print(3, params{.sep=" ", .end="\n", .out=batched, .flush=false, .policy=&every_three});
+    }
+    check_result(batched_buf.str() + std::to_string(batched_buf.flushes) + "\n", "0\n1\n2\n3\n2\n", "policy flushes on destruction");
+
+    std::ostringstream by_bytes;
+    flush_policy after_bytes(flush_policy::options{.after_bytes = 8});
+    print("abc", params{.sep=" ", .end="\n", .out=by_bytes, .flush=false, .policy=&after_bytes});
+    check_result(by_bytes.str(), "", "after_bytes holds lines back");
+    print("defg", params{.sep=" ", .end="\n", .out=by_bytes, .flush=false, .policy=&after_bytes});
+    check_result(by_bytes.str(), "abc\ndefg\n", "after_bytes writes batch");
+
+    std::ostringstream timed;
+    flush_policy hourly(flush_policy::options{.interval = std::chrono::hours(1)});
+    print("pending", params{.sep=" ", .end="\n", .out=timed, .flush=false, .policy=&hourly});
+    check_result(timed.str(), "", "interval holds lines back");
+    flush_all();
+    check_result(timed.str(), "pending\n", "flush_all");
+
+    std::cout << "Flush tests passed\n";
+}
+
+// Test that atomic lines from many threads never interleave
+void test_atomic_lines() {
+    constexpr int threads = 32;
+    constexpr int lines = 500;
+    std::ostringstream os;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&os, t] {
+            std::vector<int> payload(t + 1, t);
+            for (int i = 0; i < lines; ++i) {
+                print("thread", t, "line", i, payload, params{.sep=" ", .end="\n", .out=os, .flush=false, .atomic=true});
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    std::vector<int> next_line(threads, 0);
+    std::istringstream in(os.str());
+    std::string line;
+    int intact = 0;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string word, line_word;
+        int t = -1, i = -1;
+        fields >> word >> t >> line_word >> i;
+        if (word != "thread" || line_word != "line" || t < 0 || t >= threads || i != next_line[t]) {
+            break;
+        }
+        std::string expected = "thread " + std::to_string(t) + " line " + std::to_string(i) + " "
+                               + format(std::vector<int>(t + 1, t), params{.end=""});
+        if (line != expected) {
+            break;
+        }
+        next_line[t]++;
+        intact++;
+    }
+    check_result(std::to_string(intact) + "\n", std::to_string(threads * lines) + "\n", "atomic lines intact");
+
+    std::ostringstream formatted;
+    formatted << std::hex;
+    std::vector<std::thread> hex_workers;
+    for (int t = 0; t < 4; ++t) {
+        hex_workers.emplace_back([&formatted] {
+            for (int i = 0; i < 100; ++i) {
+                print(255, std::vector<int>{10, 11}, params{.out=formatted, .atomic=true});
+            }
+        });
+    }
+    for (auto& w : hex_workers) {
+        w.join();
+    }
+    std::string expected;
+    for (int i = 0; i < 400; ++i) {
+        expected += "ff [a,b]\n";
+    }
+    check_result(formatted.str(), expected, "atomic lines keep format state");
+
+    std::cout << "Atomic line tests passed\n";
+}
+
+// String buffer whose writes wait until it is opened, to back up an async printer's queue
+class gated_buffer : public std::stringbuf {
+public:
+    std::atomic<bool> open{false};
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        while (!open.load()) {
+            std::this_thread::yield();
+        }
+        return std::stringbuf::xsputn(s, n);
+    }
+};
+
+// Collects lines written to it, for checking output to sinks
+struct string_sink: sink {
+    std::string lines;
+    int flushes = 0;
+
+    void write(char const* data, std::size_t size) override {
+        lines.append(data, size);
+    }
+
+    void flush() override {
+        ++flushes;
+    }
+};
+
+// Test printing through a background writer thread
+void test_async_print() {
+    std::ostringstream os;
+    {
+        async_printer printer(async_printer::options{.capacity = 4});
+        std::vector<int> v = {1, 2, 3};
+        for (int i = 0; i < 100; ++i) {
+            printer.print("line", i, v, params{.sep=" ", .end="\n", .out=os, .flush=false});
+        }
+        printer.print(std::string(1000, 'x'), params{.sep=" ", .end="\n", .out=os, .flush=false});
+        printer.drain();
+        check_result(std::to_string(printer.written()) + "\n", "101\n", "async written count");
+    }
+    std::string expected;
+    for (int i = 0; i < 100; ++i) {
+        expected += format("line", i, std::vector<int>{1, 2, 3});
+    }
+    expected += std::string(1000, 'x') + "\n";
+    check_result(os.str(), expected, "async output matches print");
+
+    gated_buffer dropping_buf;
+    std::ostream dropping(&dropping_buf);
+    std::uint64_t dropped = 0;
+    {
+        async_printer printer(async_printer::options{.capacity = 2, .when_full = async_printer::overflow::drop});
+        for (int i = 0; i < 50; ++i) {
+            printer.print(i, params{.sep=" ", .end="\n", .out=dropping, .flush=false});
+        }
+        dropped = printer.dropped();
+        dropping_buf.open = true;
+    }
+    std::string written = dropping_buf.str();
+    std::size_t lines = static_cast<std::size_t>(std::count(written.begin(), written.end(), '\n'));
+    check_result(std::to_string(lines + dropped) + "\n", "50\n", "async drop accounts for every line");
+    check_result(std::string(dropped > 0 ? "dropped" : "none") + "\n", "dropped\n", "async drop when full");
+
+    gated_buffer growing_buf;
+    std::ostream growing(&growing_buf);
+    {
+        async_printer printer(async_printer::options{.capacity = 2, .when_full = async_printer::overflow::grow});
+        for (int i = 0; i < 50; ++i) {
+            printer.print(i, params{.sep=" ", .end="\n", .out=growing, .flush=false});
+        }
+        check_result(std::to_string(printer.dropped()) + "\n", "0\n", "async grow drops nothing");
+        growing_buf.open = true;
+    }
+    expected.clear();
+    for (int i = 0; i < 50; ++i) {
+        expected += std::to_string(i) + "\n";
+    }
+    check_result(growing_buf.str(), expected, "async grow keeps order");
+
+    // Lines spill to the overflow list while others still sit in the ring; each thread's lines stay in order
+    std::ostringstream ordered;
+    {
+        async_printer printer(async_printer::options{.capacity = 2, .when_full = async_printer::overflow::grow});
+        std::vector<std::thread> producers;
+        for (int t = 0; t < 4; ++t) {
+            producers.emplace_back([&printer, &ordered, t] {
+                for (int i = 0; i < 2000; ++i) {
+                    printer.print(t, i, params{.out=ordered});
+                }
+            });
+        }
+        for (auto& producer : producers) {
+            producer.join();
+        }
+    }
+    std::vector<int> next(4, 0);
+    std::istringstream ordered_lines(ordered.str());
+    int t = 0, i = 0, in_order = 0;
+    while (ordered_lines >> t >> i) {
+        in_order += t >= 0 && t < 4 && next[t] == i;
+        next[t] = i + 1;
+    }
+    check_result(std::to_string(in_order) + "\n", "8000\n", "async grow keeps each thread's order");
+
+    flush_counting_buffer drained_buf;
+    std::ostream drained(&drained_buf);
+    {
+        async_printer printer;
+        std::string written_so_far;
+        for (int round = 0; round < 50; ++round) {
+            printer.print(round, params{.out=drained});
+            printer.drain();
+            written_so_far += std::to_string(round) + "\n";
+            if (drained_buf.str() != written_so_far || drained_buf.flushes <= round) {
+                break;
+            }
+        }
+        check_result(drained_buf.str(), written_so_far, "async drain waits for the line");
+        check_result(std::to_string(drained_buf.flushes) + "\n", "50\n", "async drain waits for the flush");
+    }
+
+    std::ostringstream unused;
+    string_sink to_sink;
+    {
+        async_printer printer;
+        printer.print("hello", 1, params{.out=unused, .to=&to_sink});
+        printer.drain();
+    }
+    check_result(to_sink.lines + unused.str(), "hello 1\n", "async print to a sink");
+
+    std::cout << "Async print tests passed\n";
+}
+
+// Test separator and end fixed at compile time
+void test_static_separators() {
+    std::string result = capture_output([](std::ostream& os) {
+        print<static_sep<',', ' '>>(1, 2, 3, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "1, 2, 3\n", "static separator");
+
+    result = capture_output([](std::ostream& os) {
+        print<static_end<'!', '\n'>, static_sep<'-'>>("a", std::vector<int>{1, 2}, std::pair<int, int>{3, 4},
+                                                    params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "a-[1,2]-(3,4)!\n", "static end and separator");
+
+    result = capture_output([](std::ostream& os) {
+        print<static_sep<>, static_end<>>(1, 2, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "12", "empty static separator and end");
+
+    result = capture_output([](std::ostream& os) {
+        os << std::hex;
+        print<static_sep<':'>>(255, 16, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "ff:10\n", "static separator with stream state");
+
+    std::cout << "Static separator tests passed\n";
+}
+
+// Iterator over a range that counts how many elements are dereferenced
+template<typename It>
+struct touch_counting_iterator {
+    using iterator_category = typename std::iterator_traits<It>::iterator_category;
+    using value_type = typename std::iterator_traits<It>::value_type;
+    using difference_type = typename std::iterator_traits<It>::difference_type;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    It it;
+    int* touches;
+
+    reference operator*() const { ++*touches; return *it; }
+    touch_counting_iterator& operator++() { ++it; return *this; }
+    touch_counting_iterator& operator--() { --it; return *this; }
+    touch_counting_iterator operator++(int) { auto old = *this; ++it; return old; }
+    touch_counting_iterator operator--(int) { auto old = *this; --it; return old; }
+    touch_counting_iterator& operator+=(difference_type n) { it += n; return *this; }
+    touch_counting_iterator& operator-=(difference_type n) { it -= n; return *this; }
+    touch_counting_iterator operator+(difference_type n) const { return {it + n, touches}; }
+    touch_counting_iterator operator-(difference_type n) const { return {it - n, touches}; }
+    difference_type operator-(const touch_counting_iterator& o) const { return it - o.it; }
+    reference operator[](difference_type n) const { return *(*this + n); }
+    bool operator==(const touch_counting_iterator& o) const { return it == o.it; }
+    bool operator!=(const touch_counting_iterator& o) const { return it != o.it; }
+    bool operator<(const touch_counting_iterator& o) const { return it < o.it; }
+};
+
+// View over a vector that counts element accesses made while printing
+struct touch_counting_view {
+    const std::vector<int>& values;
+    mutable int touches = 0;
+
+    touch_counting_iterator<std::vector<int>::const_iterator> begin() const { return {values.begin(), &touches}; }
+    touch_counting_iterator<std::vector<int>::const_iterator> end() const { return {values.end(), &touches}; }
+    std::size_t size() const { return values.size(); }
+};
+
+// Test numpy-style truncation of large and deeply nested containers
+void test_truncation() {
+    std::vector<int> v(100);
+    for (int i = 0; i < 100; ++i) v[i] = i + 1;
+    std::string result = capture_output([&v](std::ostream& os) {
+        print(v, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=10});
+    });
+    check_result(result, "[1,2,3,...,98,99,100]\n", "truncated vector");
+
+    touch_counting_view view{v};
+    result = capture_output([&view](std::ostream& os) {
+        print(view, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=10, .edge_items=2});
+    });
+    check_result(result, "[1,2,...,99,100]\n", "truncated view");
+    check_result(std::to_string(view.touches) + "\n", "4\n", "only printed elements are touched");
+
+    result = capture_output([&v](std::ostream& os) {
+        print(v, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=100});
+    });
+    check_result(result, format(v), "vector at max_items is not truncated");
+
+    std::list<int> l(v.begin(), v.end());
+    result = capture_output([&l](std::ostream& os) {
+        print(l, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=5, .edge_items=1});
+    });
+    check_result(result, "[1,...,100]\n", "truncated list");
+
+    std::forward_list<int> fl(v.begin(), v.end());
+    result = capture_output([&fl](std::ostream& os) {
+        print(fl, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=5});
+    });
+    check_result(result, "[1,2,3,...]\n", "forward_list keeps the head");
+
+    std::forward_list<int> short_fl = {1, 2, 3, 4, 5};
+    result = capture_output([&short_fl](std::ostream& os) {
+        print(short_fl, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=5});
+    });
+    check_result(result, "[1,2,3,4,5]\n", "short forward_list is not truncated");
+
+    std::priority_queue<int> pq(v.begin(), v.end());
+    std::stack<int> stk;
+    for (int x : v) stk.push(x);
+    result = capture_output([&pq, &stk](std::ostream& os) {
+        print(pq, stk, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=6, .edge_items=2});
+    });
+    check_result(result, "[100,99,...,2,1] [100,99,...,2,1]\n", "truncated adapters");
+
+    std::vector<std::vector<std::vector<int>>> nested = {{{1, 2}, {3}}, {{}, {4}}};
+    result = capture_output([&nested](std::ostream& os) {
+        print(nested, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_depth=2});
+    });
+    check_result(result, "[[[...],[...]],[[],[...]]]\n", "max_depth");
+
+    std::map<int, std::vector<int>> m = {{1, v}, {2, {}}};
+    result = capture_output([&m](std::ostream& os) {
+        print(m, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_items=4, .edge_items=1});
+    });
+    check_result(result, "[(1,[1,...,100]),(2,[])]\n", "truncation applies to nested containers");
+
+    std::cout << "Truncation tests passed\n";
+}
+
+// Test that contiguous numeric containers format exactly as operator<< would, element by element
+template <typename T>
+std::string joined_with_stream(std::vector<T> const& values) {
+    std::ostringstream expected;
+    expected << "[";
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        expected << (i == 0 ? "" : ",") << values[i];
+    }
+    expected << "]\n";
+    return expected.str();
+}
+
+template <typename T>
+void check_contiguous_numbers(std::vector<T> const& values, const std::string& test_name) {
+    std::string result = capture_output([&values](std::ostream& os) {
+        print(values, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, joined_with_stream(values), test_name);
+}
+
+void test_contiguous_numbers() {
+    std::vector<uint64_t> unsigned_values{0, std::numeric_limits<uint64_t>::max()};
+    std::vector<int64_t> signed_values{std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()};
+    uint64_t power = 1;
+    for (int digits = 0; digits < 20; ++digits, power *= 10) {
+        for (uint64_t v : {power - 1, power, power + 1, power * 5 - 1}) {
+            unsigned_values.push_back(v);
+            signed_values.push_back(static_cast<int64_t>(v));
+            signed_values.push_back(-static_cast<int64_t>(v));
+        }
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < 5000; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        unsigned_values.push_back(state >> (state % 64));
+        signed_values.push_back(static_cast<int64_t>(state) >> (state % 64));
+    }
+    check_contiguous_numbers(unsigned_values, "contiguous uint64_t");
+    check_contiguous_numbers(signed_values, "contiguous int64_t");
+
+    std::vector<int32_t> ints;
+    std::vector<uint32_t> uints;
+    std::vector<int16_t> shorts;
+    std::vector<float> floats;
+    std::vector<double> doubles;
+    for (int64_t v : signed_values) {
+        ints.push_back(static_cast<int32_t>(v));
+        uints.push_back(static_cast<uint32_t>(v));
+        shorts.push_back(static_cast<int16_t>(v));
+        doubles.push_back(static_cast<double>(v) / 1024);
+        floats.push_back(static_cast<float>(v) / 3);
+    }
+    ints.push_back(std::numeric_limits<int32_t>::min());
+    uints.push_back(std::numeric_limits<uint32_t>::max());
+    doubles.push_back(std::numeric_limits<double>::infinity());
+    check_contiguous_numbers(ints, "contiguous int32_t");
+    check_contiguous_numbers(uints, "contiguous uint32_t");
+    check_contiguous_numbers(shorts, "contiguous int16_t");
+    check_contiguous_numbers(floats, "contiguous float");
+    check_contiguous_numbers(doubles, "contiguous double");
+    check_contiguous_numbers(std::vector<char>{'a', 'b', 'c'}, "contiguous char");
+
+    std::string result = capture_output([](std::ostream& os) {
+        print(std::array<uint8_t, 3>{'x', 'y', 'z'}, std::array<bool, 2>{true, false}, std::vector<long>{},
+              params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "[x,y,z] [1,0] []\n", "contiguous small types");
+
+    result = capture_output([](std::ostream& os) {
+        print(std::vector<std::vector<int>>{{1, 2}, {3}}, params{.sep=" ", .end="\n", .out=os, .flush=false, .max_depth=1});
+    });
+    check_result(result, "[[...],[...]]\n", "contiguous numbers respect max_depth");
+
+    std::cout << "Contiguous numeric container tests passed\n";
+}
+
+#if defined(PYPRINT_HAS_POSIX)
+std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Test printing to raw file descriptor and memory-mapped sinks
+void test_sinks() {
+    std::string expected;
+    for (int i = 0; i < 2000; ++i) {
+        expected += std::to_string(i) + " [" + std::to_string(i) + "," + std::to_string(-i) + "]\n";
+    }
+    const std::string path = "/tmp/pyprint_test_sink_" + std::to_string(::getpid());
+
+    {
+        fd_sink out(path.c_str(), 4096); // Small batches, so lines straddle batch boundaries
+        std::cout << std::hex; // Sinks use default formatting
+        for (int i = 0; i < 2000; ++i) {
+            print(i, std::vector<int>{i, -i}, params{.to=&out});
+        }
+        std::cout << std::dec;
+        check_result(out.good() ? "good" : "failed", "good", "fd_sink state");
+    }
+    check_result(read_file(path), expected, "fd_sink output");
+
+    {
+        mmap_sink out(path.c_str(), 1000); // Small chunks, so the mapping grows several times
+        for (int i = 0; i < 2000; ++i) {
+            print(i, std::vector<int>{i, -i}, params{.flush=true, .to=&out});
+        }
+        check_result(std::to_string(out.size()), std::to_string(expected.size()), "mmap_sink size");
+    }
+    check_result(read_file(path), expected, "mmap_sink output truncated to what was written");
+
+    {
+        fd_sink out(path.c_str());
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t) {
+            threads.emplace_back([&out] {
+                for (int i = 0; i < 500; ++i) {
+                    print(std::string(100, 'x'), params{.to=&out});
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+    std::string lines = read_file(path);
+    check_result(std::to_string(std::count(lines.begin(), lines.end(), '\n')), "4000", "concurrent fd_sink lines");
+    check_result(lines.size() == 4000 * 101 && lines.find_first_not_of("x\n") == std::string::npos ? "whole" : "torn",
+                 "whole", "concurrent fd_sink lines intact");
+
+    fd_sink missing("/nonexistent/pyprint/file");
+    print("dropped", params{.to=&missing});
+    check_result(missing.good() ? "good" : "failed", "failed", "fd_sink open failure");
+
+    std::remove(path.c_str());
+    std::cout << "Sink tests passed\n";
+}
+#endif
+
+// Test that printing nested containers allocates nothing once the thread's buffers are warm
+class discard_buffer : public std::streambuf {
+protected:
+    int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+void test_no_heap_allocations() {
+    std::map<std::string, std::vector<std::tuple<int, double, std::string>>> nested = {
+        {"a key longer than the small string buffer", {{1, 2.5, "a value longer than the small string buffer"}, {2, -0.125, "x"}}},
+        {"b", {}},
+    };
+    std::priority_queue<std::string> pq;
+    for (int i = 0; i < 100; ++i) {
+        pq.push("item number " + std::to_string(i * 37 % 100) + " with a long tail");
+    }
+    std::priority_queue<int> numbers;
+    for (int i = 0; i < 10000; ++i) {
+        numbers.push(i * 7919 % 10007);
+    }
+    std::bitset<1000> mask;
+    mask.set(3);
+    discard_buffer discard;
+    std::ostream null_out(&discard);
+    char text[512];
+
+    auto print_all = [&] {
+        print(nested, pq, mask, params{.out=null_out});
+        print(numbers, params{.out=null_out, .max_items=10});
+        print<static_sep<',', ' '>>(nested, pq, params{.out=null_out});
+        format_to(text, nested, params{.end=""});
+    };
+    print_all();
+    std::size_t const before = g_allocations.load();
+    print_all();
+    std::size_t const allocations = g_allocations.load() - before;
+    check_result(std::to_string(allocations) + "\n", "0\n", "warm print of nested containers allocates nothing");
+
+    std::cout << "Heap allocation tests passed\n";
+}
+
+// Test the pyprint::formatter customization point
+void test_formatter() {
+    std::string result = capture_output([](std::ostream& os) {
+        os << std::hex << std::setw(30); // Formatters ignore the stream state
+        print(price{1234}, price{-250}, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "12.34 -2.50\n", "formatter with size hint");
+    check_result(format(price{-5}, price{-99}, price{-100}, price{0}), "-0.05 -0.99 -1.00 0.00\n",
+                 "formatter keeps the sign of amounts under one unit");
+
+    order o{7, {{100}, {250}}};
+    check_result(format(o), "order#7 [1.00,2.50]\n", "formatter takes precedence over operator<<");
+    check_result(format(std::map<int, order>{{1, o}}, std::vector<price>{{1}, {2}}),
+                 "[(1,order#7 [1.00,2.50])] [0.01,0.02]\n", "formatter types nested in containers");
+    check_result(std::to_string(formatted_size(o)), "20", "formatter types in formatted_size");
+
+    std::cout << "Formatter tests passed\n";
+}
+
+// Test that measure and formatted_size give the exact length of the output
+template <typename... Ts>
+void check_measure(const std::string& test_name, Ts const&... args) {
+    check_result(std::to_string(formatted_size(args...)) + "\n", std::to_string(format(args...).size()) + "\n", test_name);
+    check_result(std::to_string(measure(args...)) + "\n", std::to_string(format(args...).size()) + "\n", test_name + " (measure)");
+}
+
+void test_measure() {
+    std::vector<long long> numbers{0, 9, 10, 99, 100, -1, -10, 12345678901234LL, std::numeric_limits<long long>::min(),
+                                   std::numeric_limits<long long>::max()};
+    check_measure("integers", numbers, std::numeric_limits<unsigned long long>::max(), static_cast<short>(-32768),
+                  static_cast<uint8_t>(200), 'x', true);
+    check_measure("strings", std::string("hello"), "literal", std::string_view("view"), static_cast<const char*>("pointer"),
+                  std::string());
+    check_measure("floats", 3.14159, -0.0, 1e300, std::vector<float>{1.5f, 2.25f});
+    check_measure("bitsets", std::bitset<0>(), std::bitset<13>(0x1A5B), std::bitset<64>(~0ull));
+    check_measure("grouped bitsets", std::bitset<13>(0x1A5B), std::bitset<4>(5), params{.bits=bitset_format::grouped});
+    check_measure("hex bitsets", std::bitset<13>(0x1A5B), std::bitset<1>(1), params{.bits=bitset_format::hex});
+    check_measure("separators", 1, 2, 3, params{.sep=" -- ", .end="<end>\n"});
+    check_measure("no arguments", params{.end="..."});
+
+    std::map<std::string, std::vector<std::tuple<int, double, std::string>>> nested = {
+        {"one", {{1, 1.5, "a"}, {2, -2.5, "bb"}}}, {"two", {}}};
+    std::priority_queue<int> pq;
+    std::stack<std::string> st;
+    std::queue<int> q;
+    for (int i = 0; i < 50; ++i) {
+        pq.push(i * 37 % 101 * (i % 3 == 0 ? 1000 : 1));
+        st.push(std::string(static_cast<std::size_t>(i % 7), 's'));
+        q.push(-i);
+    }
+    std::forward_list<int> fl{1, 22, 333, 4444, 55555, 666666, 7777777};
+    std::list<int> li{1, 22, 333, 4444, 55555, 666666, 7777777};
+    std::tuple<> empty_tuple;
+    auto values = std::make_tuple(nested, pq, st, q, fl, li, empty_tuple, std::make_pair(-1, std::string("x")),
+                                  std::vector<bool>{true, false}, std::vector<std::vector<int>>{{}, {1}, {2, 3}});
+    std::apply([](auto const&... all) {
+        check_measure("containers", all...);
+        check_measure("truncated containers", all..., params{.max_items=4});
+        check_measure("truncated containers, one edge item", all..., params{.max_items=3, .edge_items=1});
+        check_measure("depth-limited containers", all..., params{.max_depth=1});
+    }, values);
+
+    check_measure("formatter types", price{123456}, order{5, {{1}, {-999}}});
+
+    std::ostringstream os;
+    os << std::hex << std::showbase;
+    std::size_t const expected = measure(255, std::vector<int>{16, 17}, params{.out=os});
+    print(255, std::vector<int>{16, 17}, params{.out=os});
+    check_result(std::to_string(expected), std::to_string(os.str().size()), "measure uses the stream's format state");
+
+    char out[8];
+    auto result = format_to_n(out, sizeof(out), std::vector<int>{1, 2, 3, 4, 5}, params{.end=""});
+    check_result(std::string(out, result.out) + " " + std::to_string(result.size), "[1,2,3,4 11", "format_to_n truncates");
+    result = format_to_n(out, sizeof(out), 42);
+    check_result(std::string(out, result.out), "42\n", "format_to_n fits");
+
+    std::cout << "Measure tests passed\n";
+}
+
+// Counts up from a start value; compared against a bound it stops there, against unbounded never
+struct counter {
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = long long;
+    using difference_type = std::ptrdiff_t;
+    using pointer = long long const*;
+    using reference = long long;
+
+    long long value;
+
+    long long operator*() const { return value; }
+    counter& operator++() { ++value; return *this; }
+    counter operator++(int) { counter old = *this; ++value; return old; }
+    bool operator==(counter const& other) const { return value == other.value; }
+    bool operator!=(counter const& other) const { return value != other.value; }
+};
+
+struct bound {
+    long long value;
+};
+
+struct unbounded {};
+
+bool operator!=(counter const& it, bound end) { return it.value < end.value; }
+bool operator!=(counter const&, unbounded) { return true; }
+
+// Yields squares on demand; like a coroutine generator it can only be iterated while non-const
+class squares {
+public:
+    struct iterator {
+        using iterator_category = std::input_iterator_tag;
+        using value_type = long long;
+        using difference_type = std::ptrdiff_t;
+        using pointer = long long const*;
+        using reference = long long;
+
+        squares* owner;
+
+        long long operator*() const { return owner->_next * owner->_next; }
+        iterator& operator++() { ++owner->_next; return *this; }
+        bool operator!=(unbounded) const { return owner->_next != owner->_stop; }
+    };
+
+    explicit squares(long long stop = -1) : _stop(stop) {}
+
+    iterator begin() { return {this}; }
+    unbounded end() { return {}; }
+
+    // How many values have been stepped past
+    long long produced() const { return _next; }
+
+private:
+    long long _next = 0;
+    long long _stop;
+};
+
+// Records how a stream was written: how many times it was flushed and what it was sent
+class flush_counter : public std::streambuf {
+public:
+    std::string text;
+    int flushes = 0;
+
+protected:
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) {
+            text.push_back(static_cast<char>(c));
+        }
+        return c;
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        text.append(s, static_cast<std::size_t>(n));
+        return n;
+    }
+
+    int sync() override {
+        ++flushes;
+        return 0;
+    }
+};
+
+// Test ranges ending in a sentinel, single-pass ranges and stream_print
+void test_ranges() {
+    check_result(format(range(counter{1}, bound{6})), "[1,2,3,4,5]\n", "sentinel range");
+    check_result(format(range(counter{1}, bound{1})), "[]\n", "empty sentinel range");
+    check_result(format(range(counter{1}, bound{101}), params{.max_items=10}), "[1,2,3,...]\n", "truncated sentinel range");
+    check_result(format(range(counter{0}, unbounded{}), params{.max_items=5, .edge_items=2}), "[0,1,...]\n",
+                 "unbounded range with max_items");
+    check_result(format(std::vector<decltype(range(counter{0}, bound{2}))>{range(counter{0}, bound{2}), range(counter{5}, bound{7})}),
+                 "[[0,1],[5,6]]\n", "nested sentinel ranges");
+    check_result(std::to_string(measure(range(counter{95}, bound{105}), params{.max_items=20})),
+                 std::to_string(format(range(counter{95}, bound{105}), params{.max_items=20}).size()), "measure sentinel range");
+
+    std::istringstream short_input("1 2 3");
+    check_result(format(range(std::istream_iterator<int>(short_input), std::istream_iterator<int>()), params{.max_items=5}),
+                 "[1,2,3]\n", "single-pass range within max_items");
+    std::istringstream long_input("1 2 3 4 5 6 7 8");
+    check_result(format(range(std::istream_iterator<int>(long_input), std::istream_iterator<int>()), params{.max_items=5}),
+                 "[1,2,3,...]\n", "single-pass range past max_items");
+    std::istringstream edge_input("1 2 3 4");
+    check_result(format(range(std::istream_iterator<int>(edge_input), std::istream_iterator<int>()),
+                        params{.max_items=2, .edge_items=3}), "[1,2,3,...]\n", "single-pass range with edge_items over max_items");
+
+    std::ostringstream oss;
+    squares generated(5);
+    stream_print(generated, params{.out=oss});
+    check_result(oss.str(), "[0,1,4,9,16]\n", "stream_print generator");
+
+    oss.str("");
+    squares endless;
+    stream_print(endless, params{.end="!\n", .out=oss, .max_items=4, .edge_items=2});
+    check_result(oss.str(), "[0,1,...]!\n", "stream_print unbounded generator with max_items");
+
+    oss.str("");
+    squares huge;
+    stream_print(huge, params{.out=oss, .max_items=2000000}, 4096);
+    check_result(oss.str() + std::to_string(huge.produced()) + "\n", "[0,1,4,...]\n3\n",
+                 "stream_print stops reading a single-pass range after the head");
+
+    oss.str("");
+    squares few(5);
+    stream_print(few, params{.out=oss, .max_items=10});
+    check_result(oss.str(), "[0,1,4,...]\n", "stream_print cuts a single-pass range of unknown length after the head");
+
+    std::vector<std::string> words(3000);
+    for (std::size_t i = 0; i < words.size(); ++i) {
+        words[i] = std::to_string(i * i);
+    }
+    flush_counter counted;
+    std::ostream counted_out(&counted);
+    stream_print(words, params{.out=counted_out}, 1024);
+    check_result(counted.text, format(words), "stream_print in pieces");
+    check_result(std::to_string(counted.flushes > 10) + "\n", "1\n", "stream_print flushes each piece");
+
+    counted.text.clear();
+    stream_print(range(counter{0}, unbounded{}), params{.out=counted_out, .max_items=100000}, 4096);
+    check_result(counted.text, "[0,1,2,...]\n", "stream_print unbounded range keeps the head only");
+#if defined(__cpp_lib_ranges)
+    check_result(format(std::views::iota(1) | std::views::transform([](int i) { return i * i; }) | std::views::take(4)),
+                 "[1,4,9,16]\n", "C++20 view");
+#endif
+
+    std::cout << "Range tests passed\n";
+}
+
+// Encode values with print's MessagePack output and read them back
+template <typename... Ts>
+void check_msgpack(const std::string& test_name, Ts const&... values) {
+    std::ostringstream oss;
+    print(values..., params{.out=oss, .encode=encoding::msgpack});
+    std::string const bytes = oss.str();
+    std::string result = "round trip\n";
+    try {
+        msgpack::reader reader(bytes);
+        if (reader.read_line<Ts...>() != std::make_tuple(values...) || !reader.done()) {
+            result = "differs\n";
+        }
+    } catch (msgpack::decode_error const& e) {
+        result = std::string(e.what()) + "\n";
+    }
+    check_result(result, "round trip\n", test_name);
+}
+
+// Bytes as hex pairs, to compare encodings
+std::string hex_bytes(const std::string& bytes) {
+    std::string hex;
+    for (unsigned char c : bytes) {
+        char digits[4];
+        std::snprintf(digits, sizeof(digits), "%02x ", c);
+        hex += digits;
+    }
+    return hex + "\n";
+}
+
+// Test MessagePack output and reading it back
+void test_msgpack() {
+    params const packed{.encode=encoding::msgpack};
+    check_result(hex_bytes(format(1, "ab", true, packed)), "93 01 a2 61 62 c3 \n", "msgpack scalars");
+    check_result(hex_bytes(format(-1, -33, 200, 70000, packed)), "94 ff d0 df cc c8 ce 00 01 11 70 \n", "msgpack integers");
+    check_result(hex_bytes(format(std::make_pair('x', 1.5), packed)), "91 92 a1 78 cb 3f f8 00 00 00 00 00 00 \n",
+                 "msgpack pair");
+    check_result(hex_bytes(format(std::vector<short>{1, -2}, std::list<int>{3}, packed)),
+                 "92 c7 05 01 68 01 00 fe ff 91 03 \n", "msgpack typed array and array");
+    check_result(hex_bytes(format(std::bitset<10>(0x2f5), packed)), "91 c7 06 02 00 00 00 0a f5 02 \n", "msgpack bitset");
+    check_result(hex_bytes(format(std::vector<int>{1, 2, 3, 4, 5}, std::list<int>{1, 2, 3, 4, 5},
+                                  params{.max_items=4, .edge_items=1, .encode=encoding::msgpack})),
+                 "92 dd 00 00 00 03 01 c0 05 dd 00 00 00 03 01 c0 05 \n", "msgpack truncated");
+
+    check_msgpack("msgpack numbers", 0, -1, 127, 128, -32, -33, 255, 256, 65535, 65536, -129, -32769,
+                  std::numeric_limits<long long>::min(), std::numeric_limits<unsigned long long>::max(),
+                  static_cast<short>(-5), 2.5f, -0.125, true, false, 'c');
+    check_msgpack("msgpack strings", std::string(), std::string(31, 'a'), std::string(32, 'b'), std::string(300, 'c'),
+                  std::string(70000, 'd'));
+    check_msgpack("msgpack containers", std::vector<int>{}, std::vector<int>(100, -7), std::vector<double>{1.5, -2.25},
+                  std::vector<std::uint8_t>{1, 200}, std::deque<long long>{1, 1LL << 40}, std::list<float>{0.5f},
+                  std::set<std::string>{"x", "y"}, std::array<int, 3>{1, 2, 3}, std::array<std::string, 2>{"p", "q"});
+    std::map<std::string, std::vector<std::tuple<int, double, std::string>>> nested = {
+        {"one", {{1, 1.5, "a"}, {2, -2.5, "bb"}}}, {"two", {}}};
+    check_msgpack("msgpack nested", nested, std::make_pair(std::vector<std::vector<int>>{{1}, {}, {2, 3}}, std::string("s")),
+                  std::make_tuple(1, std::make_tuple('a', std::bitset<70>(0x123456789ULL)), std::vector<bool>{true, false}));
+
+    std::vector<int> large(70000);
+    for (std::size_t i = 0; i < large.size(); ++i) {
+        large[i] = static_cast<int>(i * 2654435761u);
+    }
+    check_msgpack("msgpack large typed array", large, std::vector<std::string>(20, "x"));
+
+    std::stack<int> stk;
+    std::priority_queue<int> pq;
+    for (int i : {3, 1, 4, 1, 5}) {
+        stk.push(i);
+        pq.push(i);
+    }
+    std::ostringstream oss;
+    print(stk, pq, range(counter{1}, bound{4}), price{250}, params{.out=oss, .encode=encoding::msgpack});
+    std::string const adapters = oss.str();
+    msgpack::reader reader(adapters);
+    auto [from_stack, from_queue, from_range, from_formatter] =
+        reader.read_line<std::vector<int>, std::vector<int>, std::vector<long long>, std::string>();
+    check_result(format(from_stack, from_queue, from_range, from_formatter), format(stk, pq, range(counter{1}, bound{4}), price{250}),
+                 "msgpack adapters, ranges and formatters read back in print order");
+
+    oss.str("");
+    squares generated(1000);
+    stream_print(generated, params{.out=oss, .encode=encoding::msgpack}, 64);
+    stream_print(large, params{.out=oss, .encode=encoding::msgpack}, 64);
+    print(std::bitset<3>(5), params{.out=oss, .encode=encoding::msgpack});
+    std::string const several = oss.str();
+    msgpack::reader lines(several);
+    auto const from_generator = std::get<0>(lines.read_line<std::vector<long long>>());
+    auto const from_stream = std::get<0>(lines.read_line<std::vector<int>>());
+    auto const bits = std::get<0>(lines.read_line<std::bitset<3>>());
+    check_result(std::to_string(from_generator.size()) + " " + std::to_string(from_generator.back()) + " " +
+                 std::to_string(from_stream == large) + " " + bits.to_string() + " " + std::to_string(lines.done()) + "\n",
+                 "1000 998001 1 101 1\n", "msgpack stream_print and several lines");
+
+    std::string error;
+    try {
+        std::string const bytes = format(std::vector<std::string>(10, "s"), params{.max_items=4, .encode=encoding::msgpack});
+        msgpack::reader truncated(bytes);
+        truncated.read_line<std::vector<std::string>>();
+    } catch (msgpack::decode_error const& e) {
+        error = e.what();
+    }
+    check_result(error + "\n", "pyprint::msgpack: nil (a truncated \"...\") cannot be read as a value\n",
+                 "msgpack truncated containers do not read back");
+
+    std::cout << "MessagePack tests passed\n";
+}
+
+#if defined(PYPRINT_STATS)
+// Test per-call-site statistics
+void test_stats() {
+    std::ostringstream oss;
+    std::vector<int> const hundred(100, 7);
+    std::map<int, std::stack<int>> nested{{1, std::stack<int>(std::deque<int>(250, 1))}};
+    unsigned const busy_line = __LINE__ + 3;
+    auto busy = [&] {
+        for (int i = 0; i < 10; ++i) {
+            PYPRINT_PRINT(i, hundred, params{.out=oss, .atomic=true});
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t) {
+        threads.emplace_back(busy);
+    }
+    busy();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    unsigned const quiet_line = __LINE__ + 1;
+    PYPRINT_PRINT(nested, params{.out=oss});
+
+    std::string result;
+    for (site_stats const& site : stats()) {
+        if (site.line == busy_line || site.line == quiet_line) {
+            std::ostringstream summary;
+            summary << (site.line == busy_line ? "busy" : "quiet") << " calls=" << site.calls << " bytes=" << site.bytes
+                    << " largest=" << site.largest_container << " timed=" << (site.format_ns + site.write_ns > 0)
+                    << " histogram=" << std::accumulate(std::begin(site.latency), std::end(site.latency), std::uint64_t(0))
+                    << " function=" << site.function << "\n";
+            result += summary.str();
+        }
+    }
+    std::size_t const busy_bytes = 40 * format(0, hundred).size();
+    check_result(result, "busy calls=40 bytes=" + std::to_string(busy_bytes) + " largest=100 timed=1 histogram=40 function=operator()\n"
+                 "quiet calls=1 bytes=" + std::to_string(format(nested).size()) + " largest=250 timed=1 histogram=1 function=test_stats\n",
+                 "stats per call site, busiest first");
+
+    auto const all = stats();
+    auto const busiest = std::find_if(all.begin(), all.end(), [&](site_stats const& site) { return site.line == busy_line; });
+    std::ostringstream dump;
+    dump << *busiest;
+    check_result(dump.str().substr(0, dump.str().find(' ')) + "\n", std::string(__FILE__) + ":" + std::to_string(busy_line) + "\n",
+                 "stats dump starts with the call site");
+    check_result(std::to_string(std::is_sorted(all.begin(), all.end(),
+                     [](site_stats const& a, site_stats const& b) { return a.bytes > b.bytes; })) + "\n", "1\n",
+                 "stats sorted by bytes");
+
+    // Once the ids run out, every new site counts under one shared (overflow) entry
+    std::deque<call_site> filler;
+    for (int i = 0; i < 4096; ++i) {
+        filler.emplace_back(__FILE__, 0, "filler");
+    }
+    unsigned const late_line = __LINE__ + 2;
+    auto late = [&](int n) {
+        PYPRINT_PRINT(n, params{.out=oss});
+    };
+    late(1);
+    late(2);
+    std::string overflow;
+    for (site_stats const& site : stats()) {
+        if (std::string(site.file) == "(overflow)") {
+            overflow += std::string(site.file) + " calls=" + std::to_string(site.calls) + "\n";
+        }
+        if (site.line == late_line || std::string(site.function) == "filler") {
+            overflow += "listed apart: " + std::to_string(site.line) + "\n";
+        }
+    }
+    check_result(overflow, "(overflow) calls=2\n", "sites past the limit reported once as (overflow)");
+
+    std::cout << "Stats tests passed\n";
+}
+#endif
+
+// Counts how often it is formatted, to check that held-back calls format nothing
+struct probe {
+    static inline int formatted = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, probe const&) {
+    ++probe::formatted;
+    return os << "probe";
+}
+
+// Clock for per_second that only moves when the test moves it
+std::int64_t fake_now_ns = 1000000000;
+
+std::int64_t fake_clock() noexcept {
+    return fake_now_ns;
+}
+
+// Test rate-limited and sampled printing
+void test_rate_limits() {
+    std::ostringstream oss;
+    for (int i = 0; i < 10; ++i) {
+        PYPRINT_EVERY_N(4, i, probe{}, params{.out=oss});
+    }
+    check_result(oss.str(), "0 probe\n4 probe (3 suppressed)\n8 probe (3 suppressed)\n", "every_n");
+    check_result(std::to_string(probe::formatted) + "\n", "3\n", "held-back calls are not formatted");
+
+    oss.str("");
+    for (int i = 0; i < 10; ++i) {
+        PYPRINT_FIRST_N(2, i, params{.sep=", ", .out=oss});
+    }
+    check_result(oss.str(), "0\n1\n", "first_n");
+
+    oss.str("");
+    limit::every_n every_third(3);
+    for (int i = 0; i < 7; ++i) {
+        print_limited(every_third, params{.sep=":", .end=";", .out=oss});
+    }
+    check_result(oss.str(), ";(2 suppressed);(2 suppressed);", "print_limited with params only");
+
+    oss.str("");
+    limit::per_second budget(5, fake_clock);
+    std::size_t admitted = 0;
+    for (int i = 0; i < 1000; ++i) {
+        admitted += print_limited(budget, "burst", params{.out=oss});
+    }
+    check_result(std::to_string(admitted) + "\n", "5\n", "per_second lets a one-second burst through");
+    fake_now_ns += 450000000;
+    oss.str("");
+    admitted = 0;
+    for (int i = 0; i < 1000; ++i) {
+        admitted += print_limited(budget, "refill", params{.out=oss});
+    }
+    check_result(std::to_string(admitted) + " " + oss.str(), "2 refill (995 suppressed)\nrefill\n",
+                 "per_second refills and reports what it held back");
+
+    limit::per_second slow(0.1, fake_clock);
+    admitted = 0;
+    for (int second = 0; second < 100; ++second) {
+        admitted += print_limited(slow, "slow", params{.out=oss});
+        fake_now_ns += 1000000000;
+    }
+    check_result(std::to_string(admitted) + "\n", "10\n", "per_second below one call a second");
+
+    oss.str("");
+    limit::sample never(0.0);
+    limit::sample always(1.0);
+    limit::sample tenth(0.1);
+    std::size_t sampled = 0;
+    std::size_t kept = 0;
+    std::ostream discard(nullptr);
+    for (int i = 0; i < 100000; ++i) {
+        print_limited(never, i, params{.out=oss});
+        kept += print_limited(always, params{.out=discard});
+        sampled += print_limited(tenth, params{.out=discard});
+    }
+    check_result(std::to_string(oss.str().empty()) + " " + std::to_string(kept) + " " +
+                 std::to_string(sampled > 9000 && sampled < 11000) + "\n", "1 100000 1\n", "sample keeps the requested fraction");
+
+    oss.str("");
+    std::atomic<std::size_t> threaded{0};
+    limit::every_n shared(100);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 2500; ++i) {
+                threaded += print_limited(shared, "x", params{.out=oss, .atomic=true});
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    check_result(std::to_string(threaded.load()) + "\n", "100\n", "every_n across threads");
+
+    std::cout << "Rate limit tests passed\n";
+}
+
+// Test writing each line, formatted once, to several destinations
+void test_tee() {
+    std::ostringstream main_out, copy1, copy2;
+    string_sink copy3;
+    int const before = probe::formatted;
+    print("tee", probe{}, std::vector<int>{1, 2}, params{.out=main_out, .tee={copy1, copy2, copy3}});
+    check_result(main_out.str(), "tee probe [1,2]\n", "tee main output");
+    check_result(copy1.str(), main_out.str(), "tee first stream");
+    check_result(copy2.str(), main_out.str(), "tee second stream");
+    check_result(copy3.lines, main_out.str(), "tee sink");
+    check_result(std::to_string(probe::formatted - before) + "\n", "1\n", "tee formats once");
+
+    print(1, params{.out=main_out, .flush=true, .tee={copy3}});
+    check_result(std::to_string(copy3.flushes) + "\n", "1\n", "tee flushes sinks");
+
+    std::ostringstream disabled;
+    print(2, params{.out=main_out, .tee={copy1, {}, disabled}});
+    check_result(disabled.str(), "", "tee stops at the first empty destination");
+
+    std::ostringstream hex_out, hex_copy;
+    hex_out << std::hex;
+    print(255, params{.out=hex_out, .tee={hex_copy}});
+    check_result(hex_copy.str(), "ff\n", "tee uses out's formatting");
+
+    std::ostringstream async_main, async_copy1, async_copy2;
+    {
+        async_printer printer;
+        for (int i = 0; i < 100; ++i) {
+            print(i, params{.out=async_main, .tee={async_copy1, async_copy2}, .tee_async=&printer});
+        }
+        printer.print("queued", params{.out=async_main, .tee={async_copy1, async_copy2}});
+        printer.drain();
+    }
+    std::string expected;
+    for (int i = 0; i < 100; ++i) {
+        expected += std::to_string(i) + "\n";
+    }
+    check_result(async_main.str(), expected + "queued\n", "async tee main output");
+    check_result(async_copy1.str(), async_main.str(), "async tee first stream");
+    check_result(async_copy2.str(), async_main.str(), "async tee second stream");
+
+    std::cout << "Tee tests passed\n";
+}
+
+// Test reusing the printed text of values that have not changed
+void test_cached() {
+    render_cache cache;
+    std::map<int, std::string> table = {{1, "one"}, {2, "two"}, {3, "three"}};
+    std::ostringstream oss;
+    print(cached(table, 1, cache), params{.out=oss});
+    print(cached(table, 1, cache), params{.out=oss});
+    check_result(oss.str(), format(table) + format(table), "cached output matches print");
+    check_result(std::to_string(cache.hits()) + " " + std::to_string(cache.misses()) + "\n", "1 1\n", "cached reuse");
+
+    table[2] = "TWO";
+    oss.str("");
+    print(cached(table, 1, cache), params{.out=oss});
+    check_result(oss.str(), "[(1,one),(2,two),(3,three)]\n", "cached keeps text while version is unchanged");
+    print(cached(table, 2, cache), params{.out=oss});
+    check_result(oss.str(), "[(1,one),(2,two),(3,three)]\n" + format(table), "cached formats a new version");
+    table[4] = "four";
+    oss.str("");
+    print(cached(table, 2, cache), params{.out=oss});
+    check_result(oss.str(), format(table), "cached formats when the size changes");
+
+    std::vector<int> v(100);
+    std::iota(v.begin(), v.end(), 0);
+    oss.str("");
+    print(cached(v, 1, cache), params{.out=oss, .max_items=10});
+    print(cached(v, 1, cache), params{.out=oss});
+    check_result(oss.str(), format(v, params{.max_items=10}) + format(v), "cached keys on limits");
+    oss.str("");
+    print("v", std::make_pair(cached(v, 1, cache), 1), params{.out=oss});
+    check_result(oss.str(), format("v", std::make_pair(v, 1)), "cached nested in a pair");
+    check_result(std::to_string(measure(cached(v, 1, cache))), std::to_string(format(v).size()), "cached measure");
+
+    std::ostringstream hex_out;
+    hex_out << std::hex;
+    print(cached(v, 1, cache), params{.out=hex_out});
+    hex_out << std::dec;
+    check_result(hex_out.str(), [&] { std::ostringstream o; o << std::hex; print(v, params{.out=o}); return o.str(); }(),
+                 "cached bypassed with stream state");
+
+    render_cache small(64);
+    std::vector<int> a(10, 1), b(10, 2), big(100, 3);
+    print(cached(a, 0, small), params{.out=oss});
+    print(cached(b, 0, small), params{.out=oss});
+    print(cached(big, 0, small), params{.out=oss});
+    check_result(std::to_string(small.bytes()) + "\n", "42\n", "cached holds at most its capacity");
+    std::uint64_t const misses = small.misses();
+    print(cached(a, 0, small), params{.out=oss});
+    print(cached(a, 0, small), params{.out=oss});
+    check_result(std::to_string(small.misses() - misses) + "\n", "0\n", "cached keeps recent entries");
+    print(cached(std::vector<int>(20, 4), 0, small), params{.out=oss});
+    print(cached(b, 0, small), params{.out=oss});
+    check_result(std::to_string(small.misses() - misses) + "\n", "2\n", "cached drops least recently used");
+
+    std::string msgpack_text, msgpack_cached;
+    {
+        std::ostringstream plain, from_cache;
+        print(v, params{.out=plain, .encode=encoding::msgpack});
+        print(cached(v, 1, cache), params{.out=from_cache, .encode=encoding::msgpack});
+        print(cached(v, 1, cache), params{.out=from_cache, .encode=encoding::msgpack});
+        msgpack_text = plain.str() + plain.str();
+        msgpack_cached = from_cache.str();
+    }
+    check_result(hex_bytes(msgpack_cached), hex_bytes(msgpack_text), "cached msgpack");
+
+    std::vector<std::thread> threads;
+    std::vector<std::string> outputs(4);
+    for (std::size_t t = 0; t < outputs.size(); ++t) {
+        threads.emplace_back([&, t] {
+            std::ostringstream out;
+            for (int i = 0; i < 200; ++i) {
+                print(cached(table, i % 3, cache), params{.out=out});
+            }
+            outputs[t] = out.str();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::string expected;
+    for (int i = 0; i < 200; ++i) {
+        expected += format(table);
+    }
+    for (auto const& output : outputs) {
+        check_result(output, expected, "cached from several threads");
+    }
+
+    std::cout << "Cached tests passed\n";
+}
+
+// Trivially copyable type printed through operator<<, for deferred records
+struct point {
+    int x;
+    int y;
+};
+
+std::ostream& operator<<(std::ostream& os, point const& pt) {
+    return os << "point(" << pt.x << ", " << pt.y << ")";
+}
+
+// Test recording print calls and formatting them later
+void test_defer() {
+    std::ostringstream direct, later;
+    std::array<double, 3> const coords = {1.5, -2.25, 1e300};
+    std::bitset<12> const flags(0xa5c);
+    char const label[] = "label";
+    int value = 42;
+    deferred_log log;
+    print(7, 'c', true, -3.5f, "literal", label, coords, flags, point{3, 4}, std::uint64_t(1) << 63, params{.out=direct});
+    log.defer(7, 'c', true, -3.5f, "literal", label, coords, flags, point{3, 4}, std::uint64_t(1) << 63, params{.out=later});
+    print("sep", 1, 2, params{.sep=", ", .end=";\n", .out=direct, .bits=bitset_format::hex});
+    log.defer("sep", 1, 2, params{.sep=", ", .end=";\n", .out=later, .bits=bitset_format::hex});
+    print(flags, params{.out=direct, .bits=bitset_format::grouped});
+    log.defer(flags, params{.out=later, .bits=bitset_format::grouped});
+    print(static_cast<void const*>(&value), params{.out=direct});
+    log.defer(static_cast<void const*>(&value), params{.out=later});
+    check_result(later.str(), "", "deferred lines wait for drain");
+    check_result(std::to_string(log.drain()) + "\n", "4\n", "drain counts lines");
+    check_result(later.str(), direct.str(), "deferred output matches print");
+    check_result(std::to_string(log.pending_bytes()) + " " + std::to_string(log.drain()) + "\n", "0 0\n",
+                 "drain empties the log");
+
+    std::ostringstream ordered;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&log, &ordered, t] {
+            for (int i = 0; i < 250; ++i) {
+                log.defer(t, i, params{.out=ordered});
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    check_result(std::to_string(log.drain()) + "\n", "1000\n", "defer from several threads");
+    std::vector<int> next(4, 0);
+    std::istringstream ordered_lines(ordered.str());
+    int t = 0, i = 0, in_order = 0;
+    while (ordered_lines >> t >> i) {
+        in_order += t >= 0 && t < 4 && next[t] == i;
+        next[t] = i + 1;
+    }
+    check_result(std::to_string(in_order) + "\n", "1000\n", "each thread's deferred lines written in order");
+
+    std::ostringstream reserved_out;
+    {
+        deferred_log reserved(std::size_t(1) << 16);
+        std::size_t const before = g_allocations.load();
+        for (int i = 0; i < 100; ++i) {
+            reserved.defer(i, 0.5, params{.out=reserved_out});
+        }
+        std::size_t const allocations = g_allocations.load() - before;
+        check_result(std::to_string(allocations) + "\n", "0\n", "defer within the reserve does not allocate");
+    }
+    std::string const reserved_lines = reserved_out.str();
+    check_result(std::to_string(std::count(reserved_lines.begin(), reserved_lines.end(), '\n')) + "\n", "100\n",
+                 "reserved log drains every line");
+
+    std::ostringstream at_exit;
+    {
+        deferred_log scoped;
+        scoped.defer("flushed", 1, params{.out=at_exit});
+    }
+    check_result(at_exit.str(), "flushed 1\n", "deferred log drains when destroyed");
+
+    std::cout << "Defer tests passed\n";
+}
+
+// Output formatted in parallel must match serial formatting byte for byte
+template <typename T>
+void check_parallel(const std::string& test_name, T const& value, params p = {}) {
+    std::ostringstream serial_out;
+    p.parallel = 0;
+    print(value, value.size(), params{.out=serial_out, .max_items=p.max_items, .max_depth=p.max_depth});
+    for (unsigned threads : {2u, 4u, 16u}) {
+        std::ostringstream parallel_out;
+        print(value, value.size(), params{.out=parallel_out, .max_items=p.max_items, .max_depth=p.max_depth,
+                                         .parallel=threads});
+        check_result(parallel_out.str(), serial_out.str(), test_name + " on " + std::to_string(threads) + " threads");
+    }
+}
+
+// Test formatting large containers on several threads
+void test_parallel() {
+    std::vector<int> ints(100003);
+    for (std::size_t i = 0; i < ints.size(); ++i) {
+        ints[i] = static_cast<int>(static_cast<std::uint32_t>(i * 2654435761u - i));
+    }
+    check_parallel("parallel ints", ints);
+    check_parallel("parallel ints in two chunks", std::vector<int>(ints.begin(), ints.begin() + 40000));
+    check_parallel("parallel truncated ints", ints, params{.max_items=1000});
+    check_parallel("parallel double", std::vector<double>(ints.begin(), ints.end()));
+
+    std::deque<std::string> strings;
+    for (int i = 0; i < 70000; ++i) {
+        strings.push_back(std::string(static_cast<std::size_t>(i % 5), static_cast<char>('a' + i % 26)));
+    }
+    check_parallel("parallel strings", strings);
+
+    std::vector<std::vector<int>> nested(50000, std::vector<int>{1, 2, 3});
+    nested[12345] = std::vector<int>(40000, 7);
+    check_parallel("parallel nested", nested);
+    check_parallel("parallel depth-limited", nested, params{.max_depth=1});
+
+    std::ostringstream hex_serial;
+    std::ostringstream hex_parallel;
+    hex_serial << std::hex << std::setw(8);
+    hex_parallel << std::hex << std::setw(8);
+    print(ints, params{.out=hex_serial});
+    print(ints, params{.out=hex_parallel, .parallel=4});
+    check_result(hex_parallel.str(), hex_serial.str(), "parallel uses the stream's format state");
+
+    std::cout << "Parallel tests passed\n";
+}
+
 // Test nested structures
 void test_nested_structures() {
     // Vector of vectors
@@ -344,6 +1932,49 @@ void test_container_custom_separator() {
     std::cout << "Container custom separator tests passed\n";
 }
 
+// Type that counts every copy or move made of it
+struct copy_counter {
+    static inline int copies = 0;
+    int value;
+
+    explicit copy_counter(int v) : value(v) {}
+    copy_counter(const copy_counter& other) : value(other.value) { copies++; }
+    copy_counter(copy_counter&& other) noexcept : value(other.value) { copies++; }
+};
+
+std::ostream& operator<<(std::ostream& os, const copy_counter& c) {
+    return os << c.value;
+}
+
+// Test that print never copies or moves its arguments
+void test_no_argument_copies() {
+    copy_counter c(7);
+    std::vector<copy_counter> vc;
+    vc.reserve(3);
+    vc.emplace_back(1);
+    vc.emplace_back(2);
+    vc.emplace_back(3);
+    std::pair<copy_counter, copy_counter> pc(copy_counter(4), copy_counter(5));
+    std::tuple<copy_counter, int> tc(copy_counter(6), 0);
+    copy_counter::copies = 0;
+
+    std::string result = capture_output([&](std::ostream& os) {
+        print(c, vc, pc, tc, params{.sep=" ", .end="\n", .out=os, .flush=false});
+    });
+    check_result(result, "7 [1,2,3] (4,5) (6,0)\n", "arguments with params");
+    check_result(std::to_string(copy_counter::copies) + "\n", "0\n", "no copies with params");
+
+    copy_counter::copies = 0;
+    std::ostringstream discard;
+    auto* old_buf = std::cout.rdbuf(discard.rdbuf());
+    print(c, vc, pc, tc);
+    std::cout.rdbuf(old_buf);
+    check_result(discard.str(), "7 [1,2,3] (4,5) (6,0)\n", "arguments without params");
+    check_result(std::to_string(copy_counter::copies) + "\n", "0\n", "no copies without params");
+
+    std::cout << "No argument copies tests passed\n";
+}
+
 int main() {
     std::cout << "Running pyprint tests...\n\n";
 
@@ -363,9 +1994,37 @@ int main() {
     test_stack();
     test_queue();
     test_priority_queue();
+    test_container_adapter_order();
     test_nested_structures();
+    test_builtin_formatting();
+    test_stream_state();
+    test_reentrant_print();
+    test_format();
+    test_flush();
+    test_atomic_lines();
+    test_async_print();
+    test_static_separators();
+    test_truncation();
+    test_contiguous_numbers();
+    test_no_heap_allocations();
+    test_formatter();
+    test_measure();
+    test_parallel();
+    test_ranges();
+    test_msgpack();
+    test_rate_limits();
+    test_tee();
+    test_cached();
+    test_defer();
+#if defined(PYPRINT_STATS)
+    test_stats();
+#endif
+#if defined(PYPRINT_HAS_POSIX)
+    test_sinks();
+#endif
     test_empty_print();
     test_container_custom_separator();
+    test_no_argument_copies();
 
     std::cout << "\n========================================\n";
     std::cout << "Test Summary:\n";